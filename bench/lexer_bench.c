@@ -0,0 +1,97 @@
+/*
+ * Lexer microbenchmark: tokens/sec of lexLine() on long generated command
+ * lines, once per delimiter scanner the CPU supports.
+ *
+ * usage: lexer_bench [line length in bytes] [iterations]
+ */
+#define SHELL_NO_MAIN
+#include "../main.c"
+
+static char *generateLine(size_t length) {
+    static const char *operators[] = {" | ", " && ", " ; ", " > out.txt ", " 2> err.txt ", " < in.txt "};
+    char *line = malloc(length + 64);
+    size_t used = 0;
+    unsigned seed = 12345;
+    while(used < length){
+        seed = seed * 1103515245u + 12345u;
+        unsigned choice = (seed >> 16) % 16;
+        if(choice == 0){
+            used += sprintf(line + used, "%s", operators[(seed >> 8) % 6]);
+        }else if(choice == 1){
+            used += sprintf(line + used, "\"quoted argument %u\" ", seed % 1000);
+        }else if(choice == 2){
+            used += sprintf(line + used, "'single %u' ", seed % 1000);
+        }else if(choice == 3){
+            used += sprintf(line + used, "escaped\\ word%u ", seed % 1000);
+        }else{
+            int wordLength = 2 + (seed >> 4) % 18;
+            for(int i = 0; i < wordLength; i++){
+                line[used++] = "abcdefghijklmnopqrstuvwxyz-_./0123456789"[(seed >> (i % 24)) % 40];
+            }
+            line[used++] = ' ';
+        }
+    }
+    line[used] = '\0';
+    return line;
+}
+
+static double secondsSince(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void runScanner(const char *name, size_t (*scanner)(const char *, size_t),
+                       const char *source, size_t length, int iterations) {
+    commandLine line;
+    initCommandLine(&line);
+    char *work = malloc(length + 1);
+    scanDelimiter = scanner;
+
+    // The lexer works in place, so every pass lexes a fresh copy. The copy
+    // is timed separately and taken out of the result.
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < iterations; i++){
+        memcpy(work, source, length + 1);
+    }
+    double copySeconds = secondsSince(&start);
+
+    long tokens = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < iterations; i++){
+        memcpy(work, source, length + 1);
+        if(lexLine(work, &line) == -1){
+            fprintf(stderr, "%s\n", line.error);
+            exit(1);
+        }
+        tokens += line.tokenCount;
+    }
+    double seconds = secondsSince(&start) - copySeconds;
+    if(seconds <= 0){
+        seconds = 1e-9;
+    }
+    printf("%-7s %12.0f tokens/sec %9.1f MB/s\n", name, tokens / seconds,
+           (double)length * iterations / seconds / 1e6);
+    free(work);
+}
+
+int main(int argc, char *argv[]) {
+    size_t length = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024 * 1024;
+    int iterations = argc > 2 ? atoi(argv[2]) : 50;
+    char *source = generateLine(length);
+    length = strlen(source);
+
+    printf("line of %zu bytes, %d iterations\n", length, iterations);
+    runScanner("scalar", scanDelimiterScalar, source, length, iterations);
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")){
+        runScanner("sse2", scanDelimiterSse2, source, length, iterations);
+    }
+    if(__builtin_cpu_supports("avx2")){
+        runScanner("avx2", scanDelimiterAvx2, source, length, iterations);
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Launch path benchmark: the shell's own cost per command, measured with a
+ * no-op command (true by default) on each way a command can be started.
+ * Prints p50/p99 latency and commands/sec for every path.
+ *
+ * usage: shell_bench [iterations] [command]
+ */
+#define SHELL_NO_MAIN
+#include "../main.c"
+
+typedef double (*launchPath)(char **args);
+
+static double secondsSince(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return elapsedSeconds(start, &now);
+}
+
+static int compareSeconds(const void *a, const void *b) {
+    double left = *(const double *)a;
+    double right = *(const double *)b;
+    return (left > right) - (left < right);
+}
+
+/* fork() and try execv() on every PATH directory in turn, as the shell first did */
+static double forkPathScan(char **args) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t child = fork();
+    if(child == 0){
+        const char *path = getenv("PATH");
+        char *copy = strdup(path == NULL ? "" : path);
+        char *savePointer;
+        for(char *directory = strtok_r(copy, ":", &savePointer); directory != NULL;
+            directory = strtok_r(NULL, ":", &savePointer)){
+            char candidate[4096];
+            snprintf(candidate, sizeof(candidate), "%s/%s", directory, args[0]);
+            execv(candidate, args);
+        }
+        _exit(127);
+    }
+    waitpid(child, NULL, 0);
+    return secondsSince(&start);
+}
+
+/* fork() and execve() the path remembered by the PATH table */
+static double forkCached(char **args) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char *executable = lookupPath(args[0]);
+    pid_t child = fork();
+    if(child == 0){
+        executeArgument(executable, args);
+    }
+    waitpid(child, NULL, 0);
+    return secondsSince(&start);
+}
+
+/* The shell's own path: posix_spawn(), job table, wait4() */
+static double spawnForeground(char **args) {
+    pipelineStage stage = {args, NULL, 0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    job *entry = executePipeline(&stage, 1, 0);
+    if(entry != NULL){
+        parent_process(entry);
+    }
+    return secondsSince(&start);
+}
+
+/* Time until a background job is started, its exit is waited for untimed */
+static double spawnBackground(char **args) {
+    pipelineStage stage = {args, NULL, 0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    job *entry = executePipeline(&stage, 1, 1);
+    double seconds = secondsSince(&start);
+    if(entry != NULL){
+        waitForJob(entry);
+    }
+    return seconds;
+}
+
+/* A builtin run inside the shell */
+static double builtinInPlace(char **args) {
+    static char *noop[] = {"cd", ".", NULL};
+    pipelineStage stage = {noop, NULL, 0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    executePipeline(&stage, 1, 0);
+    return secondsSince(&start);
+}
+
+/* A builtin as a pipeline stage, in a forked child */
+static double builtinForked(char **args) {
+    static char *noop[] = {"cd", ".", NULL};
+    pipelineStage stages[2] = {{noop, NULL, 0}, {args, NULL, 0}};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    job *entry = executePipeline(stages, 2, 0);
+    if(entry != NULL){
+        parent_process(entry);
+    }
+    return secondsSince(&start);
+}
+
+static void runPath(const char *name, launchPath launch, char **args, int iterations) {
+    double *samples = malloc(iterations * sizeof(double));
+    for(int i = 0; i < iterations / 20 + 1; i++){
+        launch(args);   /* warm up the PATH table and the slabs */
+    }
+    double total = 0;
+    for(int i = 0; i < iterations; i++){
+        samples[i] = launch(args);
+        total += samples[i];
+    }
+    reapChildren();
+    qsort(samples, iterations, sizeof(double), compareSeconds);
+    printf("%-18s p50 %8.1f us  p99 %8.1f us  %9.0f cmds/sec\n", name, samples[iterations / 2] * 1e6,
+           samples[(int)(iterations * 0.99)] * 1e6, total > 0 ? iterations / total : 0.0);
+    free(samples);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    char *args[] = {argc > 2 ? argv[2] : "true", NULL};
+    if(iterations < 1){
+        iterations = 1;
+    }
+    batchMode = 1;  /* no job notices or history */
+    nullInputFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    initJobTable();
+    initEventLoop();
+    fillPath();
+    if(lookupPath(args[0]) == NULL){
+        fprintf(stderr, "%s: command not found\n", args[0]);
+        return 127;
+    }
+
+    printf("%s, %d iterations per path\n", args[0], iterations);
+    runPath("fork+exec PATH", forkPathScan, args, iterations);
+    runPath("fork+exec cached", forkCached, args, iterations);
+    runPath("spawn foreground", spawnForeground, args, iterations);
+    runPath("spawn background", spawnBackground, args, iterations);
+    runPath("builtin", builtinInPlace, args, iterations);
+    runPath("builtin forked", builtinForked, args, iterations);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
@@ -6,612 +7,5015 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <spawn.h>
+#include <stdio_ext.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/file.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-#define MAX_LINE 80 /* 80 chars per line, per command, should be enough. */
+// LINE READER
+#define READ_AHEAD_SIZE (64 * 1024)   /* bytes requested from the input per read() */
+#define BATCH_READ_AHEAD_SIZE (1024 * 1024)
+#define LINE_INITIAL_SIZE 256
+#define ARGS_INLINE_CAPACITY 16         /* arguments stored without allocating */
+#define ARENA_BLOCK_SIZE (16 * 1024)
+#define ARENA_ALIGNMENT 16
+
+/* Bump allocator for everything parsed from one line, emptied by arenaReset() */
+typedef struct arenaBlock {
+    struct arenaBlock *previousBlock;
+    size_t size;
+    size_t used;
+}arenaBlock;
+
+typedef struct {
+    arenaBlock *current;    /* block allocations come from, older blocks are chained behind it */
+}arena;
+
+typedef struct {
+    int fd;
+    size_t readAhead;       /* size of buffer */
+    char *buffer;           /* read-ahead buffer */
+    size_t start;           /* first byte not handed out yet */
+    size_t end;             /* one past the last byte read */
+    char *line;             /* growable buffer for lines that do not fit in place */
+    size_t lineCapacity;
+    int endOfFile;
+    int mapped;             /* buffer is a private mapping of a script file */
+    size_t lastLineStart;   /* mapped: where the line handed out last begins */
+    size_t released;        /* mapped: pages before this offset were given back */
+}lineReader;
+
+/* NULL terminated argument vector, small lines stay in inlineItems */
+typedef struct {
+    char **items;
+    int count;
+    int capacity;
+    arena *memory;          /* where the items go once they outgrow inlineItems */
+    char *inlineItems[ARGS_INLINE_CAPACITY];
+}argVector;
 
 // INPUT OUTPUT
-#define CREATE_FLAGS (O_WRONLY | O_CREAT | O_APPEND)
+#define CREATE_FLAGS (O_WRONLY | O_CREAT | O_TRUNC)
 #define CREATE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
 #define CREATE_APPENDFLAGS (O_WRONLY | O_APPEND | O_CREAT )
 
-char INPUT_FILE[50];
-char OUTPUT_FILE[50];
+#define FD_OPEN 0           /* open file onto fd */
+#define FD_DUP 1            /* make fd a copy of source */
+#define FD_CLOSE 2          /* close fd */
+
+/* One step of a stage's redirection plan, built by addRedirection() */
+typedef struct {
+    int operation;
+    int fd;
+    int source;             /* FD_DUP */
+    int flags;              /* FD_OPEN */
+    char *file;             /* FD_OPEN */
+}fdOperation;
+
+typedef struct {
+    char **args;            /* NULL terminated arguments of this stage */
+    fdOperation *plan;      /* redirections in the order they are carried out */
+    int planLength;
+}pipelineStage;
+
+// LEXER
+#define TOKEN_WORD 0
+#define TOKEN_PIPE 1        /* | */
+#define TOKEN_AND 2         /* && */
+#define TOKEN_SEMICOLON 3   /* ; */
+#define TOKEN_BACKGROUND 4  /* & */
+#define TOKEN_INPUT 5       /* [n]< */
+#define TOKEN_OUTPUT 6      /* [n]> */
+#define TOKEN_APPEND 7      /* [n]>> */
+#define TOKEN_DUPLICATE_INPUT 8     /* [n]<& */
+#define TOKEN_DUPLICATE_OUTPUT 9    /* [n]>& */
+#define TOKEN_OUTPUT_ALL 10 /* &> */
+#define TOKEN_APPEND_ALL 11 /* &>> */
+/* every type from TOKEN_INPUT on is a redirection followed by a word */
+
+#define CONNECT_ALWAYS 0    /* after ; or & or at the start of the line */
+#define CONNECT_AND 1       /* after &&, runs only if the previous pipeline succeeded */
+
+typedef struct {
+    int type;
+    char *text;     /* the word, NULL for operators */
+    int fd;         /* descriptor a redirection applies to */
+}token;
+
+typedef struct {
+    int firstStage; /* index into commandLine.stages */
+    int stageCount;
+    int background;
+    int connector;
+}pipeline;
+
+/* One parsed command line, its arrays live in memory and are dropped by the next setup() */
+typedef struct {
+    arena memory;
+    token *tokens;
+    int tokenCount;
+    int tokenCapacity;
+    argVector args;         /* words of every stage, each stage NULL terminated */
+    pipelineStage *stages;
+    int stageCount;
+    int stageCapacity;
+    pipeline *pipelines;
+    int pipelineCount;
+    int pipelineCapacity;
+    fdOperation *operations;    /* redirection plans of every stage */
+    int operationCount;
+    int operationCapacity;
+    char error[128];        /* syntax error, reported when the line would run */
+}commandLine;
+
+size_t scanDelimiterScalar(const char *text, size_t position);
+
+/* Finds the next byte that can end a plain run of word characters */
+size_t (*scanDelimiter)(const char *text, size_t position) = scanDelimiterScalar;
+
+static const unsigned char delimiterTable[256] = {
+    ['\0'] = 1, [' '] = 1, ['\t'] = 1, ['\''] = 1, ['"'] = 1, ['\\'] = 1,
+    ['&'] = 1, [';'] = 1, ['|'] = 1, ['<'] = 1, ['>'] = 1,
+};
+
+// PATH LOOKUP CACHE
+#define PATH_TABLE_INITIAL_SIZE 256 /* must be a power of two */
+#define PATH_CHECK_INTERVAL_NS 1000000000u  /* PATH directories are stat()ed at most this often */
+
+extern char **environ;
+
+typedef struct {
+    char *name;
+    char *path;     /* NULL marks a negative entry, the name is in no PATH directory */
+    int dirIndex;   /* directory the name was resolved in, pathDirectoryCount for negatives */
+    int hits;
+}pathEntry;
+
+typedef struct {
+    char *name;
+    struct timespec mtime;
+}pathDirectory;
+
+pathEntry *pathTable = NULL;
+size_t pathTableSize = 0;
+size_t pathTableUsed = 0;
+pathDirectory *pathDirectories = NULL;
+int pathDirectoryCount = 0;
+char *pathSnapshot = NULL;  /* value of PATH the table was built from */
+uint64_t pathCheckedAt = 0; /* phaseClock() of the last stat() of the directories, 0 forces one */
+
+// JOB TABLE
+#define SLAB_OBJECTS_PER_CHUNK 64
+#define PROCESS_INDEX_INITIAL_SIZE 64 /* must be a power of two */
+#define FINISHED_JOBS_KEPT 32
+#define JOB_COMMAND_LENGTH 64
 
+/* Fixed-size object pool, freed objects are kept on a free list for reuse */
 typedef struct {
+    size_t objectSize;
+    void *freeList;
+}slabAllocator;
+
+struct job;
+
+typedef struct backgroundProcess {
     pid_t id;
-    struct backgroundProcess *nextBackgroundProcess;
+    int pidfd;      /* -1 if none could be opened, the pid is used then */
+    int watched;    /* pidfd is in the epoll set, its exit is reaped from the loop */
+    int status;     /* wait status once the process is reaped */
+    int running;
+    int stopped;    /* reported stopped by waitid(WSTOPPED) and not continued since */
+    struct rusage usage;        /* from wait4() once reaped */
+    struct timespec finished;   /* CLOCK_MONOTONIC at the time it was reaped */
+    struct job *owner;
+    struct backgroundProcess *nextInJob;
+    struct backgroundProcess *nextBackgroundProcess;    /* next process in the same pid index bucket */
 }backgroundProcess;
 
+typedef struct job {
+    int id;
+    int background;
+    int processCount;
+    int runningCount;
+    int stoppedCount;
+    pid_t processGroup;     /* 0 without job control */
+    int pinned;     /* still looked at by parallel, not dropped from the finished list */
+    int timedOut;   /* a timeout signal was sent */
+    char *cgroup;   /* limit: cgroup directory of the job, removed when it finishes */
+    backgroundProcess *firstProcess;
+    backgroundProcess *lastProcess;
+    struct timespec started;    /* CLOCK_MONOTONIC when the job was created */
+    char command[JOB_COMMAND_LENGTH];
+    struct job *previousJob;
+    struct job *nextJob;
+}job;
+
 typedef struct {
-    char* command;
-    struct bookmark *nextBookmark;
-}bookmark;
+    job *head;
+    job *tail;
+    int count;
+}jobList;
+
 
-backgroundProcess *headRunningBackgroundProcess = NULL;
-backgroundProcess *headFinishedBackgroundProcess = NULL;
-bookmark *headBookmark = NULL;
+slabAllocator jobSlab = {sizeof(job), NULL};
+slabAllocator processSlab = {sizeof(backgroundProcess), NULL};
+jobList runningJobs = {NULL, NULL, 0};
+jobList finishedJobs = {NULL, NULL, 0};
+backgroundProcess **processIndex = NULL;   /* pid -> process, chained buckets */
+size_t processIndexSize = 0;
+size_t processIndexCount = 0;
+int nextJobId = 1;
+int unreportedJobs = 0;     /* finished background jobs not yet announced */
+int unwatchedProcesses = 0; /* running processes without a pidfd in the epoll set, reaped on SIGCHLD */
+long pidfdCount = 0;        /* pidfds held for running processes */
+long pidfdLimit = 0;        /* at most this many, RLIMIT_NOFILE less PIDFD_RESERVE */
 
-pid_t foregroundProcessID;
+job *foregroundJob;
 int foreground = 0;
+int jobControl = 0;         /* interactive: jobs get process groups and the terminal */
+pid_t shellGroup;
+struct termios shellModes;  /* terminal modes given back to the shell after a job */
+
+typedef struct {
+    const char *name;
+    int number;
+}signalName;
+
+const signalName signalNames[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+    {"USR2", SIGUSR2}, {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP},
+};
+int lastExitStatus = 0;     /* exit status of the last pipeline, used by && */
+
+// BOOKMARK STORE
+#define BOOKMARK_FILE ".myshell_bookmarks"     /* in $HOME */
+#define BOOKMARK_MAGIC "MYSHBKM2"
+#define BOOKMARK_INITIAL_CAPACITY 64
+#define BOOKMARK_INITIAL_HEAP 4096
+#define BOOKMARK_MAX_DEPTH 8       /* bookmark -i run from within bookmarks */
+
+/*
+ * The bookmark file is mapped shared and used in place: a header, an array
+ * of records indexed by bookmark number, then the command text. Every shell
+ * takes flock() on the file around each access and remaps it when another
+ * shell has grown it.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t count;         /* bookmarks in use, records[0..count) */
+    uint32_t capacity;      /* records the index has room for */
+    uint64_t heapStart;     /* file offset of the command text */
+    uint64_t heapUsed;      /* bytes of text written, deleted text included */
+    uint64_t heapGarbage;   /* bytes of text that belonged to deleted bookmarks */
+}bookmarkHeader;
+
+typedef struct {
+    uint64_t offset;        /* from heapStart */
+    uint32_t length;        /* without the terminating null character */
+    uint32_t parsedLength;  /* parsed form stored after the text, 0 if there is none */
+}bookmarkRecord;
+
+/*
+ * Parsed form of a bookmark, as written by saveCommandLine(): this header,
+ * the pipelines, the stages, the redirection plans, the arguments as offsets
+ * into the word pool with -1 for the NULL ending each stage, then the pool.
+ */
+typedef struct {
+    uint32_t pipelineCount;
+    uint32_t stageCount;
+    uint32_t operationCount;
+    uint32_t argCount;
+    uint32_t poolLength;
+}savedCommandLine;
+
+typedef struct {
+    int32_t argStart;
+    int32_t planStart;
+    int32_t planLength;
+}savedStage;
+
+typedef struct {
+    int32_t operation;
+    int32_t fd;
+    int32_t source;
+    int32_t flags;
+    int32_t file;       /* offset into the word pool, -1 for none */
+}savedOperation;
+
+int bookmarkFd = -1;
+char *bookmarkMap = NULL;
+size_t bookmarkMapSize = 0;
+commandLine bookmarkLine;   /* new bookmarks are parsed here before they are stored */
+
+// HISTORY
+#define HISTORY_FILE ".myshell_history"            /* in $HOME, one command per line */
+#define HISTORY_INDEX_FILE ".myshell_history.idx"  /* entry n starts at byte index[n] - 1 of the log, 0 while it is written */
+#define HISTORY_RING_FILE ".myshell_history.ring"  /* the latest entries, shared by all shells */
+#define HISTORY_TRIGRAM_FILE ".myshell_history.tri" /* snapshot of the trigram index of the first entries */
+#define HISTORY_MAGIC "MYSHHST1"
+#define TRIGRAM_MAGIC "MYSHTRI1"
+#define TRIGRAM_SAVE_MIN 1024           /* entries indexed past the snapshot before it is rewritten, */
+#define TRIGRAM_SAVE_SHARE 8            /* and at least 1/8 of those in it */
+#define HISTORY_RING_SIZE 1024          /* must be a power of two */
+#define HISTORY_SLOT_TEXT 244           /* longer entries are read back from the log */
+#define TRIGRAM_TABLE_INITIAL_SIZE 4096 /* must be a power of two */
+
+typedef struct {
+    uint64_t sequence;  /* 2n + 1 while entry n is written, 2n + 2 once it is complete */
+    uint32_t length;    /* of the whole entry, only HISTORY_SLOT_TEXT bytes are kept */
+    char text[HISTORY_SLOT_TEXT];
+}historySlot;
+
+typedef struct {
+    char magic[8];
+    uint64_t head;      /* number of the next entry */
+    uint64_t logEnd;    /* bytes of the log claimed so far */
+    historySlot slots[HISTORY_RING_SIZE];   /* entry n lives in slot n modulo the size */
+}historyRing;
+
+/* Entries containing one trigram, the key packs its three bytes and 0 marks a free slot */
+typedef struct {
+    uint32_t trigram;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *entries;  /* ascending entry numbers, after those in saved */
+    const uint32_t *saved;  /* the list in the mapped snapshot */
+    uint32_t savedCount;
+}trigramPosting;
+
+/* Snapshot file: the header, then trigramCount records sorted by trigram, then the lists */
+typedef struct {
+    char magic[8];
+    uint64_t covered;       /* entries below this are in it */
+    uint64_t lastOffset;    /* index value of entry covered - 1, tells a rebuilt log apart */
+    uint64_t trigramCount;
+}trigramSnapshot;
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t offset;        /* of the list from the start of the file */
+}trigramRecord;
+
+historyRing *historyShared = NULL;
+int historyLogFd = -1;
+int historyIndexFd = -1;
+char *historyLog = NULL;    /* read-only mappings of the two files */
+size_t historyLogSize = 0;
+uint64_t *historyIndex = NULL;
+size_t historyIndexSize = 0;
+trigramPosting *trigramTable = NULL;    /* built on the first search */
+size_t trigramTableSize = 0;
+size_t trigramTableUsed = 0;
+long trigramIndexed = 0;    /* entries below this are in the trigram index */
+long trigramSaved = 0;      /* entries below this are in the snapshot file */
+int trigramLoaded = 0;      /* the snapshot was looked for */
+
+// LIMIT
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_HYBRID_ROOT "/sys/fs/cgroup/unified"     /* cgroup2 beside v1 hierarchies */
+#define CGROUP_PERIOD 100000                            /* cpu.max period in microseconds */
 
-void child_process(char *pString[41]);
+/* What limit asks for, 0 for no limit */
+typedef struct {
+    double cpus;
+    long long memory;       /* bytes */
+    long nofile;
+}jobLimits;
+
+int jobCgroupCount = 0;     /* names the next job cgroup */
+
+// PARALLEL
+#define PARALLEL_MAX_FAILURES 101   /* exit status once more jobs than this failed */
+#define XARGS_HEADROOM 2048         /* bytes of ARG_MAX left unused, as POSIX xargs does */
+
+typedef struct {
+    backgroundProcess *process;     /* NULL for a free slot, its job is pinned */
+    char **argv;        /* one allocation holding the vector and the item strings */
+}parallelSlot;
+
+/* Produces the argument vector of the next child, NULL when there is none */
+typedef char **(*batchSource)(void *state);
+
+/* Where parallel takes its items from */
+typedef struct {
+    char **prefix;      /* command and fixed arguments */
+    int prefixLength;
+    char **items;       /* the words after :::, NULL to read lines from stdin */
+    int index;
+}parallelItems;
+
+/* Where xargs packs its items from */
+typedef struct {
+    char **prefix;
+    int prefixLength;
+    int delimiter;      /* '\n' or '\0' */
+    long maxItems;      /* per batch, 0 for no limit */
+    size_t budget;      /* bytes of strings and pointers one exec may take for the items */
+    char *pending;      /* item read ahead that did not fit in the last batch */
+    size_t pendingLength;
+}xargsItems;
+
+// EVENT LOOP
+#define EVENT_BATCH 8                   /* epoll events taken per wait */
+#define PIDFD_RESERVE 256               /* descriptors left for pipes and redirections, jobs beyond go without a pidfd */
+#define NOTICE_DELAY_NS 5000000         /* job notices of a burst of exits share one prompt redraw */
+#define TIMEOUT_GRACE_NS 5000000000ull  /* from the timeout signal to SIGKILL unless -k says otherwise */
+#define TIMER_INITIAL_CAPACITY 16
+
+enum {TIMER_NOTICE, TIMER_JOB};
+
+/* A deadline in the timer heap */
+typedef struct {
+    uint64_t deadline;      /* CLOCK_MONOTONIC nanoseconds */
+    int kind;
+    job *entry;             /* TIMER_JOB: the job to signal, its timers go when it finishes */
+    int signal;
+    uint64_t grace;         /* then SIGKILL this much later, 0 for no follow-up */
+}shellTimer;
+
+/*
+ * The shell blocks SIGCHLD, SIGTSTP and SIGINT and reads them from a
+ * signalfd, so nothing runs in signal handler context. Waiting for a line,
+ * for a foreground job or for parallel children all go through runEvents().
+ */
+int eventFd = -1;           /* epoll instance, -1 in forked children which must not share it */
+int signalFd = -1;
+int timerFd = -1;           /* CLOCK_MONOTONIC, armed for the earliest deadline in the heap */
+shellTimer *timerHeap = NULL;   /* binary min-heap on deadline */
+int timerCount = 0;
+int timerCapacity = 0;
+int watchedInputFd = -1;    /* command stream in the epoll set, -1 if it cannot be polled */
+int atPrompt = 0;           /* waiting for a typed line, exits are announced right away */
+int noticePending = 0;      /* timer armed to announce finished jobs */
+sigset_t shellSignals;
+posix_spawnattr_t spawnAttributes;  /* clears the blocked signals in spawned children */
+
+// BATCH MODE
+int batchMode = 0;          /* no prompt, commands come from a pipe or file */
+int nullInputFd = -1;       /* /dev/null, stdin of batch children */
+long commandsExecuted = 0;
+struct timespec batchStart;
+pid_t shellPid;
+
+// PHASE STATS
+#define PHASE_SUB_BITS 3            /* 8 buckets per power of two, about 12% resolution */
+#define PHASE_BUCKETS ((64 - PHASE_SUB_BITS + 1) << PHASE_SUB_BITS)
+
+/* Steps of running a command line, each with a latency histogram */
+enum {PHASE_READ, PHASE_LEX, PHASE_DISPATCH, PHASE_RESOLVE, PHASE_FORK, PHASE_SPAWN, PHASE_WAIT, PHASE_COUNT};
+
+/*
+ * Log-linear histogram of nanoseconds, as in HDR histograms: values below
+ * 2^PHASE_SUB_BITS have a bucket each, above that every power of two is
+ * split into 2^PHASE_SUB_BITS equal buckets. Recording is a clz and an
+ * increment.
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[PHASE_BUCKETS];
+}phaseHistogram;
+
+const char *phaseNames[PHASE_COUNT] = {"read", "lex", "dispatch", "resolve", "fork", "spawn", "wait"};
+phaseHistogram phaseStats[PHASE_COUNT];
+
+// BUILTINS
+typedef int (*builtinFunction)(char **args);
+
+typedef struct {
+    const char *name;
+    builtinFunction run;
+}shellBuiltin;
+
+/*
+ * Builtins live in a perfect hash table that is laid out at compile time:
+ * the slot of a name depends only on its first character and its length.
+ * When adding a builtin make sure its slot is not already taken, a repeated
+ * designated initializer would silently replace the earlier entry.
+ */
+#define BUILTIN_TABLE_SIZE 32
+#define BUILTIN_SLOT(first, length) ((((unsigned)(first)) * 4u + (unsigned)(length) * 7u) & (BUILTIN_TABLE_SIZE - 1))
+#define BUILTIN_ENTRY(first, literal, function) [BUILTIN_SLOT(first, sizeof(literal) - 1)] = {literal, function}
+
+void child_process(pipelineStage *stage, char *executable);
+
+
+job *executePipeline(pipelineStage *stages, int stageCount, int background);
+
+int writeToPipe(int fd, const char *buffer, size_t length);
+
+const shellBuiltin *findBuiltin(const char *name);
+
+int runBuiltin(const shellBuiltin *command, pipelineStage *stage);
+
+int runBuiltinToPipe(const shellBuiltin *command, char **pString);
 
-void parent_process(pid_t child, int background, char *pString[41]);
+int runRedirections(fdOperation *plan, int length);
+
+int builtinPsAll(char **args);
+
+int builtinBookmark(char **args);
+
+int builtinExit(char **args);
+
+int builtinCd(char **args);
+
+int builtinPwd(char **args);
+
+int builtinHash(char **args);
+
+int builtinHistory(char **args);
+
+int builtinParallel(char **args);
+
+int builtinXargs(char **args);
+
+int builtinTime(char **args);
+
+int builtinShellstat(char **args);
+
+int builtinJobs(char **args);
+
+int builtinFg(char **args);
+
+int builtinBg(char **args);
+
+int builtinKill(char **args);
+
+job *findJobArgument(const char *name, const char *argument);
+
+void continueJob(job *entry, int background);
+
+int parseSignal(const char *text);
+
+uint64_t phaseClock();
+
+void recordPhase(int phase, uint64_t start);
+
+uint64_t phaseBucketStart(int bucket);
+
+uint64_t phasePercentile(phaseHistogram *histogram, double fraction);
+
+double elapsedSeconds(struct timespec *start, struct timespec *end);
+
+void printUsage(FILE *out, double wall, struct rusage *usage);
+
+double jobUsage(job *entry, struct rusage *total);
+
+int runBatches(const char *name, char *executable, long limit, int nullInput, batchSource next, void *state);
+
+char **makeBatch(char **prefix, int prefixLength, char **items, int itemCount);
+
+char **nextParallelItem(void *state);
+
+char **nextXargsBatch(void *state);
+
+pid_t spawnProcess(char *executable, pipelineStage *stage, int inputFd, int outputFd, pid_t group, int terminal);
+
+void parent_process(job *newJob);
 
 void fillPath();
 
-void executeArgument(char **pString);
+char *lookupPath(const char *name);
+
+void validatePath();
 
-void createNewBackgroundProcess(pid_t child);
+void dropPathEntries(int fromDirectory);
 
-void addNewBackgroundProcess(backgroundProcess *root, backgroundProcess *process);
+pathEntry *findPathEntry(const char *name);
 
-void moveBackgroundProcessToFinished(backgroundProcess *process);
+void insertPathEntry(char *name, char *path, int dirIndex, int hits);
+
+void clearPathTable();
+
+void hashCommands(char **pString);
+
+void executeArgument(char *executable, char **pString);
+
+void *slabAllocate(slabAllocator *slab);
+
+void slabFree(slabAllocator *slab, void *object);
+
+void initJobTable();
+
+job *createJob(int background, pipelineStage *stages, int stageCount);
+
+backgroundProcess *createNewBackgroundProcess(job *owner, pid_t child);
+
+void reapExitedProcess(pid_t pid);
+
+int signalProcess(backgroundProcess *process, int signal);
+
+void addNewBackgroundProcess(backgroundProcess *process);
+
+backgroundProcess *findBackgroundProcess(pid_t pid);
+
+void removeBackgroundProcess(backgroundProcess *process);
+
+void appendJob(jobList *list, job *entry);
+
+void removeJob(jobList *list, job *entry);
+
+void moveBackgroundProcessToFinished(backgroundProcess *process, int status, struct rusage *usage);
+void closeJobDescriptors();
+
+void reapProcess(pid_t pid, int status, struct rusage *usage);
+
+void freeJob(job *entry);
+
+void initEventLoop();
+
+void initJobControl();
+
+void updateStoppedProcesses();
+
+void watchInput(int fd);
+
+void waitForInput(int fd);
+
+int runEvents(int timeout);
+
+void handleSignals();
+
+void armTimer(uint64_t deadline);
+
+void expireTimers();
+
+void pushTimer(shellTimer timer);
+
+void removeTimer(int index);
+
+void cancelJobTimers(job *entry);
+
+void fireTimer(shellTimer *timer, uint64_t now);
+
+int64_t parseDuration(const char *text);
+
+int builtinTimeout(char **args);
+
+int builtinLimit(char **args);
+
+long long parseSize(const char *text);
+
+char *createJobCgroup(jobLimits *limits);
+
+int writeCgroupFile(const char *directory, const char *file, const char *value);
+
+void applyLimits(jobLimits *limits, const char *cgroup);
+
+void joinProcessGroup(pid_t group, int terminal);
+
+void reportBatchRate();
+
+void reapChildren();
+
+void waitForJob(job *entry);
+
+void notifyFinishedJobs();
 
 void printProcesses();
 
-void initLinkedList();
+void initBookmarkStore();
+
+bookmarkHeader *lockBookmarks(int operation);
 
-void control_z(int signal);
+void unlockBookmarks();
+
+void control_z();
 
 void checkAndExit();
 
 void bookmarkCommands(char **pString);
+int runBookmark(const char *argument);
 
-void listBookmarks(bookmark *root);
+void listBookmarks();
 
-void deleteBookmark(bookmark *root, int index);
+void deleteBookmark(int index);
 
 char *prepareCommand(char **pString);
 
-void addNewBookmark(bookmark *root, char* command);
+void addNewBookmark(const char *command);
 
-char *findCommand(int index);
+int loadBookmark(int index, commandLine *line, FILE *echo);
 
+size_t saveCommandLine(commandLine *line, char *out);
 
-// INPUT OUTPUT METHODS
-int checkInputOutput(char **args);
+int loadCommandLine(commandLine *line, const char *data);
+
+void initHistory();
+
+void syncHistory();
+
+long rebuildHistoryIndex();
+
+long historyEntries();
+
+void addHistory(const char *text);
+
+const char *historyText(long number, size_t *length);
+
+void indexHistory();
+void loadTrigramIndex();
+void saveTrigramIndex();
+
+void searchHistory(const char *pattern);
+
+int compareEntryNumbers(const void *first, const void *second);
+
+void listHistory(long count);
+
+void promoteHistory(long number);
+
+
+static const shellBuiltin builtinTable[BUILTIN_TABLE_SIZE] = {
+    BUILTIN_ENTRY('p', "ps_all", builtinPsAll),
+    BUILTIN_ENTRY('b', "bookmark", builtinBookmark),
+    BUILTIN_ENTRY('e', "exit", builtinExit),
+    BUILTIN_ENTRY('c', "cd", builtinCd),
+    BUILTIN_ENTRY('p', "pwd", builtinPwd),
+    BUILTIN_ENTRY('h', "hash", builtinHash),
+    BUILTIN_ENTRY('h', "history", builtinHistory),
+    BUILTIN_ENTRY('p', "parallel", builtinParallel),
+    BUILTIN_ENTRY('x', "xargs", builtinXargs),
+    BUILTIN_ENTRY('t', "time", builtinTime),
+    BUILTIN_ENTRY('s', "shellstat", builtinShellstat),
+    BUILTIN_ENTRY('j', "jobs", builtinJobs),
+    BUILTIN_ENTRY('f', "fg", builtinFg),
+    BUILTIN_ENTRY('b', "bg", builtinBg),
+    BUILTIN_ENTRY('k', "kill", builtinKill),
+    BUILTIN_ENTRY('t', "timeout", builtinTimeout),
+    BUILTIN_ENTRY('l', "limit", builtinLimit),
+};
+
+void initLineReader(lineReader *reader, int fd, size_t readAhead);
+
+int initMappedLineReader(lineReader *reader, const char *file);
+
+char *readLine(lineReader *reader);
+
+void initArgVector(argVector *vector, arena *memory);
+
+void pushArg(argVector *vector, char *arg);
 
-int truncateOutput();
+void initLexer();
 
-int appendOutput();
+int lexLine(char *text, commandLine *line);
 
-int getInput();
+int parseCommandLine(commandLine *line);
 
-int outputError();
+void initCommandLine(commandLine *line);
 
-/* The setup function below will not return any value, but it will just: read
-in the next command line; separate it into distinct arguments (using blanks as
-delimiters), and set the args array entries to point to the beginning of what
-will become null-terminated, C-style strings. */
+void resetCommandLine(commandLine *line);
 
-void setup(char inputBuffer[], char *args[],int *background)
+void *arenaAllocate(arena *memory, size_t size);
+
+void *arenaGrow(arena *memory, void *items, size_t oldSize, size_t newSize);
+
+char *arenaCopy(arena *memory, const char *text);
+
+void arenaReset(arena *memory);
+
+// INPUT OUTPUT METHODS
+int addRedirection(commandLine *line, int type, int fd, char *word);
+
+int planRedirections(fdOperation *plan, int length);
+
+/* The setup function below returns 0 at the end of the input, otherwise it will
+just: read in the next command line; split it into tokens with lexLine() and
+group them into pipelines with parseCommandLine(). Words point into the line,
+which is unquoted in place and becomes null-terminated, C-style strings. A line
+with a syntax error comes back with no pipelines and the message in line->error,
+it is reported when the line would have run. */
+
+int setup(lineReader *reader, commandLine *line)
 {
-    int length, /* # of characters in the command line */
-    i,      /* loop index for accessing inputBuffer array */
-    start,  /* index where beginning of next command parameter is */
-    ct;     /* index of where to place the next parameter into args[] */
-
-    ct = 0;
-
-    /* read what the user enters on the command line */
-    length = read(STDIN_FILENO,inputBuffer,MAX_LINE);
-
-    /* 0 is the system predefined file descriptor for stdin (standard input),
-       which is the user's screen in this case. inputBuffer by itself is the
-       same as &inputBuffer[0], i.e. the starting address of where to store
-       the command that is read, and length holds the number of characters
-       read in. inputBuffer is not a null terminated C-string. */
-
-    start = -1;
-    if (length == 0)
-        exit(0);            /* ^d was entered, end of user command stream */
-
-/* the signal interrupted the read system call */
-/* if the process is in the read() system call, read returns -1
-  However, if this occurs, errno is set to EINTR. We can check this  value
-  and disregard the -1 value */
-    if ( (length < 0) && (errno != EINTR) ) {
-        perror("error reading the command");
-        exit(-1);           /* terminate with error code of -1 */
-    }
-
-    //printf(">>%s<<",inputBuffer);
-    for (i=0;i<length;i++){ /* examine every character in the inputBuffer */
-
-        switch (inputBuffer[i]){
-            case ' ':
-            case '\t' :               /* argument separators */
-                if(start != -1){
-                    args[ct] = &inputBuffer[start];    /* set up pointer */
-                    ct++;
-                }
-                inputBuffer[i] = '\0'; /* add a null char; make a C string */
-                start = -1;
-                break;
+    char *inputBuffer;
 
-            case '\n':                 /* should be the final char examined */
-                if (start != -1){
-                    args[ct] = &inputBuffer[start];
-                    ct++;
-                }
-                inputBuffer[i] = '\0';
-                args[ct] = NULL; /* no more arguments to this command */
-                break;
+    resetCommandLine(line);
 
-            default :             /* some other character */
-                if (start == -1)
-                    start = i;
-                if (inputBuffer[i] == '&'){
-                    *background  = 1;
-                    inputBuffer[i-1] = '\0';
-                }
-        } /* end of switch */
-    }    /* end of for */
-    args[ct] = NULL; /* just in case the input line was > 80 */
+    /* read the next complete line, however long it is. The line is a null
+       terminated C-string without its newline and stays valid until the
+       next call. */
+    uint64_t start = phaseClock();
+    inputBuffer = readLine(reader);
+    recordPhase(PHASE_READ, start);
 
-    /*
-    for (i = 0; i <= ct; i++)
-        printf("args %d = %s\n",i,args[i]);
-    */
+    if (inputBuffer == NULL)
+        return 0;           /* ^d was entered, end of user command stream */
+
+    if(!batchMode){
+        addHistory(inputBuffer);
+    }
 
+    start = phaseClock();
+    if(lexLine(inputBuffer, line) == -1 || parseCommandLine(line) == -1){
+        line->pipelineCount = 0;
+    }
+    recordPhase(PHASE_LEX, start);
+    return 1;
 
 } /* end of setup routine */
 
-int main(void)
-{
-    char inputBuffer[MAX_LINE]; /*buffer to hold command entered */
-    int background; /* equals 1 if a command is followed by '&' */
-    char *args[MAX_LINE/2 + 1]; /*command line arguments */
+#if defined(__x86_64__) || defined(__i386__)
+static inline unsigned delimiterMask16(const char *block) {
+    __m128i bytes = _mm_load_si128((const __m128i *)block);
+    __m128i hit = _mm_cmpeq_epi8(bytes, _mm_setzero_si128());
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\'')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('&')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(';')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('|')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('<')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('>')));
+    return (unsigned)_mm_movemask_epi8(hit);
+}
+
+/*
+ * The vector scanners only do aligned loads. An aligned block never crosses
+ * a page, so reading the bytes around the string cannot fault, and the bits
+ * of bytes before the start position are masked off.
+ */
+size_t scanDelimiterSse2(const char *text, size_t position) {
+    const char *start = text + position;
+    const char *block = (const char *)((uintptr_t)start & ~(uintptr_t)15);
+    unsigned mask = delimiterMask16(block) & (~0u << (start - block));
+    while(mask == 0){
+        block += 16;
+        mask = delimiterMask16(block);
+    }
+    return (block - text) + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned delimiterMask32(const char *block) {
+    __m256i bytes = _mm256_load_si256((const __m256i *)block);
+    __m256i hit = _mm256_cmpeq_epi8(bytes, _mm256_setzero_si256());
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\t')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\'')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\\')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('&')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(';')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('|')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('<')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('>')));
+    return (unsigned)_mm256_movemask_epi8(hit);
+}
+
+__attribute__((target("avx2")))
+size_t scanDelimiterAvx2(const char *text, size_t position) {
+    const char *start = text + position;
+    const char *block = (const char *)((uintptr_t)start & ~(uintptr_t)31);
+    unsigned mask = delimiterMask32(block) & (~0u << (start - block));
+    while(mask == 0){
+        block += 32;
+        mask = delimiterMask32(block);
+    }
+    return (block - text) + __builtin_ctz(mask);
+}
+#endif
+
+size_t scanDelimiterScalar(const char *text, size_t position) {
+    while(!delimiterTable[(unsigned char)text[position]]){
+        position++;
+    }
+    return position;
+}
+
+/* Pick the widest delimiter scanner the CPU supports */
+void initLexer() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        scanDelimiter = scanDelimiterAvx2;
+    }else if(__builtin_cpu_supports("sse2")){
+        scanDelimiter = scanDelimiterSse2;
+    }
+#endif
+}
+
+static void syntaxError(commandLine *line, const char *format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(line->error, sizeof(line->error), format, arguments);
+    va_end(arguments);
+}
+
+static void pushToken(commandLine *line, int type, char *text, int fd) {
+    if(line->tokenCount == line->tokenCapacity){
+        line->tokenCapacity = line->tokenCapacity == 0 ? 32 : line->tokenCapacity * 2;
+        line->tokens = arenaGrow(&line->memory, line->tokens, line->tokenCount * sizeof(token),
+                                 line->tokenCapacity * sizeof(token));
+    }
+    token *next = &line->tokens[line->tokenCount++];
+    next->type = type;
+    next->text = text;
+    next->fd = fd;
+}
+
+/*
+ * Split a line into words and operators in a single pass. Quotes and
+ * backslashes are removed in place, so words always fit where they were
+ * read from. Runs of ordinary characters are skipped with scanDelimiter().
+ * Returns -1 on a syntax error, described in line->error.
+ */
+int lexLine(char *text, commandLine *line) {
+    size_t i = 0;
+    line->tokenCount = 0;
+    while(1){
+        char c = text[i];
+        if(c == ' ' || c == '\t'){
+            i++;
+            continue;
+        }
+        if(c == '\0' || c == '#'){
+            /* end of line, or a word starting with # comments out the rest */
+            return 0;
+        }
+
+        int fd = -1;
+        if(c != '|' && c != '&' && c != ';' && c != '<' && c != '>'){
+            char *word = &text[i];
+            size_t w = i;       /* where the next unquoted byte is written */
+            int quoted = 0;
+            while(1){
+                size_t next = scanDelimiter(text, i);
+                if(w != i){
+                    memmove(&text[w], &text[i], next - i);
+                }
+                w += next - i;
+                i = next;
+                c = text[i];
+                if(c == '\\'){
+                    if(text[i + 1] != '\0'){
+                        text[w++] = text[i + 1];
+                        i += 2;
+                    }else{
+                        i++;
+                    }
+                    quoted = 1;
+                }else if(c == '\''){
+                    char *close = strchr(&text[i + 1], '\'');
+                    if(close == NULL){
+                        syntaxError(line, "syntax error: unterminated '");
+                        return -1;
+                    }
+                    size_t length = close - &text[i + 1];
+                    memmove(&text[w], &text[i + 1], length);
+                    w += length;
+                    i += length + 2;
+                    quoted = 1;
+                }else if(c == '"'){
+                    i++;
+                    while(text[i] != '"'){
+                        if(text[i] == '\0'){
+                            syntaxError(line, "syntax error: unterminated \"");
+                            return -1;
+                        }
+                        if(text[i] == '\\' && (text[i + 1] == '"' || text[i + 1] == '\\')){
+                            i++;
+                        }
+                        text[w++] = text[i++];
+                    }
+                    i++;
+                    quoted = 1;
+                }else{
+                    break;
+                }
+            }
+            /* c is the delimiter at text[i], terminating the word may overwrite it */
+            text[w] = '\0';
+            size_t digits = strspn(word, "0123456789");
+            int last = line->tokenCount == 0 ? TOKEN_WORD : line->tokens[line->tokenCount - 1].type;
+            int duplicating = last == TOKEN_DUPLICATE_INPUT || last == TOKEN_DUPLICATE_OUTPUT;
+            if(!quoted && !duplicating && (c == '<' || c == '>') && digits > 0 && word[digits] == '\0'){
+                fd = atoi(word);    /* a descriptor number such as the 2 of 2> */
+            }else{
+                pushToken(line, TOKEN_WORD, word, -1);
+                if(c == '\0'){
+                    return 0;
+                }
+                if(c == ' ' || c == '\t'){
+                    i++;
+                    continue;
+                }
+            }
+        }
+
+        /* operators, c is the first character and text[i + 1] is intact */
+        char following = text[i + 1];
+        if(c == '|'){
+            pushToken(line, TOKEN_PIPE, NULL, -1);
+            i++;
+        }else if(c == '&' && following == '&'){
+            pushToken(line, TOKEN_AND, NULL, -1);
+            i += 2;
+        }else if(c == '&' && following == '>' && text[i + 2] == '>'){
+            pushToken(line, TOKEN_APPEND_ALL, NULL, -1);
+            i += 3;
+        }else if(c == '&' && following == '>'){
+            pushToken(line, TOKEN_OUTPUT_ALL, NULL, -1);
+            i += 2;
+        }else if(c == '&'){
+            pushToken(line, TOKEN_BACKGROUND, NULL, -1);
+            i++;
+        }else if(c == ';'){
+            pushToken(line, TOKEN_SEMICOLON, NULL, -1);
+            i++;
+        }else if(c == '<' && following == '&'){
+            pushToken(line, TOKEN_DUPLICATE_INPUT, NULL, fd == -1 ? STDIN_FILENO : fd);
+            i += 2;
+        }else if(c == '<'){
+            pushToken(line, TOKEN_INPUT, NULL, fd == -1 ? STDIN_FILENO : fd);
+            i++;
+        }else if(c == '>' && following == '>'){
+            pushToken(line, TOKEN_APPEND, NULL, fd == -1 ? STDOUT_FILENO : fd);
+            i += 2;
+        }else if(c == '>' && following == '&'){
+            pushToken(line, TOKEN_DUPLICATE_OUTPUT, NULL, fd == -1 ? STDOUT_FILENO : fd);
+            i += 2;
+        }else{
+            pushToken(line, TOKEN_OUTPUT, NULL, fd == -1 ? STDOUT_FILENO : fd);
+            i++;
+        }
+    }
+}
+
+static pipelineStage *newStage(commandLine *line) {
+    if(line->stageCount == line->stageCapacity){
+        line->stageCapacity = line->stageCapacity == 0 ? 8 : line->stageCapacity * 2;
+        line->stages = arenaGrow(&line->memory, line->stages, line->stageCount * sizeof(pipelineStage),
+                                 line->stageCapacity * sizeof(pipelineStage));
+    }
+    pipelineStage *stage = &line->stages[line->stageCount++];
+    stage->args = NULL;
+    stage->plan = NULL;
+    stage->planLength = 0;
+    return stage;
+}
+
+static void pushOperation(commandLine *line, int operation, int fd, int source, int flags, char *file) {
+    if(line->operationCount == line->operationCapacity){
+        line->operationCapacity = line->operationCapacity == 0 ? 8 : line->operationCapacity * 2;
+        line->operations = arenaGrow(&line->memory, line->operations, line->operationCount * sizeof(fdOperation),
+                                     line->operationCapacity * sizeof(fdOperation));
+    }
+    fdOperation *next = &line->operations[line->operationCount++];
+    next->operation = operation;
+    next->fd = fd;
+    next->source = source;
+    next->flags = flags;
+    next->file = file;
+}
+
+static pipeline *newPipeline(commandLine *line, int connector) {
+    if(line->pipelineCount == line->pipelineCapacity){
+        line->pipelineCapacity = line->pipelineCapacity == 0 ? 4 : line->pipelineCapacity * 2;
+        line->pipelines = arenaGrow(&line->memory, line->pipelines, line->pipelineCount * sizeof(pipeline),
+                                    line->pipelineCapacity * sizeof(pipeline));
+    }
+    pipeline *next = &line->pipelines[line->pipelineCount++];
+    next->firstStage = line->stageCount;
+    next->stageCount = 0;
+    next->background = 0;
+    next->connector = connector;
+    return next;
+}
+
+/*
+ * Group the tokens into pipelines separated by ;, & and &&. The words of
+ * every stage go into line->args, each stage ending with a NULL, and the
+ * stage args pointers are filled in once the vector has stopped growing.
+ * Returns -1 on a syntax error, described in line->error.
+ */
+int parseCommandLine(commandLine *line) {
+    // Sized by the input, so from the line arena rather than the stack
+    int *argStart = arenaAllocate(&line->memory, (line->tokenCount + 1) * sizeof(int));
+    int *planStart = arenaAllocate(&line->memory, (line->tokenCount + 1) * sizeof(int));
+    int connector = CONNECT_ALWAYS;
+    int pipeFollows = 0;    /* the last stage ended with | */
+    pipeline *current = NULL;
+    pipelineStage *stage = NULL;
+
+    line->args.count = 0;
+    line->stageCount = 0;
+    line->pipelineCount = 0;
+    line->operationCount = 0;
+    for(int i = 0; i <= line->tokenCount; i++){
+        token *next = i < line->tokenCount ? &line->tokens[i] : NULL;
+        int type = next == NULL ? TOKEN_SEMICOLON : next->type;
+
+        if(type == TOKEN_WORD || type >= TOKEN_INPUT){
+            if(current == NULL){
+                current = newPipeline(line, connector);
+            }
+            if(stage == NULL){
+                pipeFollows = 0;
+                argStart[line->stageCount] = line->args.count;
+                planStart[line->stageCount] = line->operationCount;
+                stage = newStage(line);
+                current->stageCount++;
+            }
+            if(type == TOKEN_WORD){
+                pushArg(&line->args, next->text);
+                continue;
+            }
+            // Redirection, the file name or descriptor is the next word
+            if(i + 1 >= line->tokenCount || line->tokens[i + 1].type != TOKEN_WORD){
+                syntaxError(line, "syntax error: missing file name after redirection");
+                return -1;
+            }
+            if(addRedirection(line, type, next->fd, line->tokens[++i].text) == -1){
+                return -1;
+            }
+            continue;
+        }
+
+        // Every other token ends the current stage
+        const char *name = type == TOKEN_PIPE ? "|" : type == TOKEN_AND ? "&&" :
+                           type == TOKEN_BACKGROUND ? "&" : next == NULL ? "end of line" : ";";
+        if(stage == NULL){
+            // Nothing before this separator: only a stray ; or the end of an empty line is fine
+            if(pipeFollows || connector == CONNECT_AND || type != TOKEN_SEMICOLON){
+                syntaxError(line, "syntax error near %s", name);
+                return -1;
+            }
+            continue;
+        }
+        if(line->args.count == argStart[line->stageCount - 1]){
+            syntaxError(line, "syntax error: redirection without a command");
+            return -1;
+        }
+        pushArg(&line->args, NULL);
+        stage->planLength = line->operationCount - planStart[line->stageCount - 1];
+        stage = NULL;
+
+        pipeFollows = type == TOKEN_PIPE;
+        if(pipeFollows){
+            continue;
+        }
+        current->background = type == TOKEN_BACKGROUND;
+        current = NULL;
+        connector = type == TOKEN_AND ? CONNECT_AND : CONNECT_ALWAYS;
+    }
+
+    // The argument vector and the plans are complete, point the stages into them
+    for(int i = 0; i < line->stageCount; i++){
+        line->stages[i].args = &line->args.items[argStart[i]];
+        line->stages[i].plan = &line->operations[planStart[i]];
+        line->stages[i].planLength = planRedirections(line->stages[i].plan, line->stages[i].planLength);
+    }
+    return 0;
+}
+
+/*
+ * Add the plan operations for one redirection of the current stage, word is
+ * the file name or, for <& and >&, a descriptor or - to close.
+ * Returns -1 on a syntax error, described in line->error.
+ */
+int addRedirection(commandLine *line, int type, int fd, char *word) {
+    if(type == TOKEN_INPUT){
+        pushOperation(line, FD_OPEN, fd, -1, O_RDONLY, word);
+    }else if(type == TOKEN_OUTPUT){
+        pushOperation(line, FD_OPEN, fd, -1, CREATE_FLAGS, word);
+    }else if(type == TOKEN_APPEND){
+        pushOperation(line, FD_OPEN, fd, -1, CREATE_APPENDFLAGS, word);
+    }else if(type == TOKEN_OUTPUT_ALL || type == TOKEN_APPEND_ALL){
+        pushOperation(line, FD_OPEN, STDOUT_FILENO, -1, type == TOKEN_OUTPUT_ALL ? CREATE_FLAGS : CREATE_APPENDFLAGS, word);
+        pushOperation(line, FD_DUP, STDERR_FILENO, STDOUT_FILENO, 0, NULL);
+    }else if(strcmp(word, "-") == 0){
+        pushOperation(line, FD_CLOSE, fd, -1, 0, NULL);
+    }else if(word[0] != '\0' && word[strspn(word, "0123456789")] == '\0'){
+        pushOperation(line, FD_DUP, fd, atoi(word), 0, NULL);
+    }else if(type == TOKEN_DUPLICATE_OUTPUT && fd == STDOUT_FILENO){
+        // >&file is the older spelling of &>file
+        return addRedirection(line, TOKEN_OUTPUT_ALL, fd, word);
+    }else{
+        syntaxError(line, "syntax error: %s is not a file descriptor", word);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Drop the operations of a plan that cannot make a difference: a dup or a
+ * close of a descriptor that a later operation replaces before anything
+ * copies it, and a dup of a descriptor onto itself. Opens always stay, the
+ * file they create or truncate is part of their effect. Compacts the plan
+ * in place and returns its new length.
+ */
+int planRedirections(fdOperation *plan, int length) {
+    int kept = 0;
+    for(int i = 0; i < length; i++){
+        int needed = !(plan[i].operation == FD_DUP && plan[i].source == plan[i].fd);
+        for(int j = i + 1; needed && plan[i].operation != FD_OPEN && j < length; j++){
+            if(plan[j].operation == FD_DUP && plan[j].source == plan[i].fd){
+                break;      /* copied before it is replaced */
+            }
+            if(plan[j].fd == plan[i].fd){
+                needed = 0;
+            }
+        }
+        if(needed){
+            plan[kept++] = plan[i];
+        }
+    }
+    return kept;
+}
+
+void initLineReader(lineReader *reader, int fd, size_t readAhead) {
+    reader->fd = fd;
+    reader->readAhead = readAhead;
+    reader->buffer = malloc(readAhead);
+    reader->start = 0;
+    reader->end = 0;
+    reader->lineCapacity = LINE_INITIAL_SIZE;
+    reader->line = malloc(reader->lineCapacity);
+    reader->endOfFile = 0;
+    reader->mapped = 0;
+    reader->lastLineStart = 0;
+    reader->released = 0;
+}
+
+static void appendToLine(lineReader *reader, size_t *length, const char *data, size_t count) {
+    if(*length + count + 1 > reader->lineCapacity){
+        while(*length + count + 1 > reader->lineCapacity){
+            reader->lineCapacity *= 2;
+        }
+        reader->line = realloc(reader->line, reader->lineCapacity);
+    }
+    memcpy(reader->line + *length, data, count);
+    *length += count;
+}
+
+/*
+ * Give back the pages of a mapped script that only hold lines which already
+ * ran. The lexer dirtied them, so they would otherwise stay resident until
+ * the end of the script. Only the line handed out last may still be in use.
+ */
+static void releaseMappedLines(lineReader *reader) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t keep = reader->lastLineStart & ~(page - 1);
+    if(keep > reader->released){
+        madvise(reader->buffer + reader->released, keep - reader->released, MADV_DONTNEED);
+        reader->released = keep;
+    }
+}
+
+/*
+ * Return the next logical line: a line ending in a backslash continues on
+ * the next one. A line found whole in the read-ahead buffer is returned in
+ * place, anything else is assembled in the growable line buffer. Returns
+ * NULL at end of input.
+ */
+char *readLine(lineReader *reader) {
+    size_t length = 0;
+    int assembling = 0;
+    if(reader->mapped){
+        releaseMappedLines(reader);
+        reader->lastLineStart = reader->start;
+    }
+    while(1){
+        char *data = reader->buffer + reader->start;
+        size_t available = reader->end - reader->start;
+        char *newline = memchr(data, '\n', available);
+        if(newline != NULL){
+            size_t count = newline - data;
+            reader->start += count + 1;
+            int continued = count > 0 && data[count - 1] == '\\';
+            if(!continued && !assembling){
+                *newline = '\0';
+                return data;
+            }
+            appendToLine(reader, &length, data, continued ? count - 1 : count);
+            if(!continued){
+                reader->line[length] = '\0';
+                return reader->line;
+            }
+            assembling = 1;
+            continue;
+        }
+
+        // No newline buffered: keep the partial line and read more
+        if(available > 0){
+            appendToLine(reader, &length, data, available);
+            assembling = 1;
+        }
+        reader->start = 0;
+        reader->end = 0;
+        if(reader->endOfFile){
+            if(!assembling){
+                return NULL;
+            }
+            reader->line[length] = '\0';
+            return reader->line;
+        }
+        waitForInput(reader->fd);
+        ssize_t count = read(reader->fd, reader->buffer, reader->readAhead);
+        /* if the process is in the read() system call when a signal arrives,
+           read returns -1 and errno is set to EINTR, just try again */
+        if(count < 0){
+            if(errno == EINTR) continue;
+            perror("error reading the command");
+            exit(-1);           /* terminate with error code of -1 */
+        }
+        if(count == 0){
+            reader->endOfFile = 1;
+        }
+        reader->end = count;
+    }
+}
+
+/*
+ * Read a script through a private writable mapping of the file instead of
+ * read(). Lines are returned in place, the tokenizer's null characters only
+ * make private copies of the pages they touch, and only a continued line or
+ * an unterminated last line is copied into the line buffer.
+ */
+int initMappedLineReader(lineReader *reader, const char *file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+        perror(file);
+        return -1;
+    }
+    struct stat info;
+    if(fstat(fd, &info) == -1){
+        perror(file);
+        close(fd);
+        return -1;
+    }
+    reader->fd = -1;
+    reader->readAhead = 0;
+    reader->buffer = NULL;
+    reader->start = 0;
+    reader->end = info.st_size;
+    reader->lineCapacity = LINE_INITIAL_SIZE;
+    reader->line = malloc(reader->lineCapacity);
+    reader->endOfFile = 1;
+    reader->mapped = 1;
+    reader->lastLineStart = 0;
+    reader->released = 0;
+    if(info.st_size > 0){
+        reader->buffer = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(reader->buffer == MAP_FAILED){
+            perror(file);
+            close(fd);
+            return -1;
+        }
+        madvise(reader->buffer, info.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return 0;
+}
+
+void initCommandLine(commandLine *line) {
+    memset(line, 0, sizeof(commandLine));
+    initArgVector(&line->args, &line->memory);
+}
+
+/* Everything the previous line in this slot allocated goes at once */
+void resetCommandLine(commandLine *line) {
+    arenaReset(&line->memory);
+    line->tokens = NULL;
+    line->tokenCount = 0;
+    line->tokenCapacity = 0;
+    line->stages = NULL;
+    line->stageCount = 0;
+    line->stageCapacity = 0;
+    line->pipelines = NULL;
+    line->pipelineCount = 0;
+    line->pipelineCapacity = 0;
+    line->operations = NULL;
+    line->operationCount = 0;
+    line->operationCapacity = 0;
+    initArgVector(&line->args, &line->memory);
+    line->error[0] = '\0';
+}
+
+void initArgVector(argVector *vector, arena *memory) {
+    vector->items = vector->inlineItems;
+    vector->count = 0;
+    vector->capacity = ARGS_INLINE_CAPACITY;
+    vector->memory = memory;
+}
+
+void pushArg(argVector *vector, char *arg) {
+    if(vector->count == vector->capacity){
+        int capacity = vector->capacity * 2;
+        vector->items = arenaGrow(vector->memory, vector->items, vector->count * sizeof(char *),
+                                  capacity * sizeof(char *));
+        vector->capacity = capacity;
+    }
+    vector->items[vector->count++] = arg;
+}
+
+/* Allocations start after the block header, rounded up to keep them aligned */
+#define ARENA_HEADER_SIZE ((sizeof(arenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+static arenaBlock *newArenaBlock(size_t size, arenaBlock *previousBlock) {
+    arenaBlock *block = malloc(ARENA_HEADER_SIZE + size);
+    if(block == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    block->previousBlock = previousBlock;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void *arenaAllocate(arena *memory, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    arenaBlock *block = memory->current;
+    if(block == NULL || block->size - block->used < size){
+        size_t blockSize = ARENA_BLOCK_SIZE;
+        while(blockSize < size){
+            blockSize *= 2;
+        }
+        block = newArenaBlock(blockSize, block);
+        memory->current = block;
+    }
+    void *object = (char *)block + ARENA_HEADER_SIZE + block->used;
+    block->used += size;
+    return object;
+}
+
+/* Move items to a bigger allocation, the old one is reclaimed with the rest of the arena */
+void *arenaGrow(arena *memory, void *items, size_t oldSize, size_t newSize) {
+    void *grown = arenaAllocate(memory, newSize);
+    if(oldSize > 0){
+        memcpy(grown, items, oldSize);
+    }
+    return grown;
+}
+
+char *arenaCopy(arena *memory, const char *text) {
+    size_t length = strlen(text) + 1;
+    return memcpy(arenaAllocate(memory, length), text, length);
+}
+
+/*
+ * Drop every allocation at once. A line that needed several blocks leaves a
+ * single block as big as all of them, so the next line like it is served
+ * without calling malloc and the arena stops growing at the largest line.
+ */
+void arenaReset(arena *memory) {
+    arenaBlock *block = memory->current;
+    if(block == NULL){
+        return;
+    }
+    if(block->previousBlock != NULL){
+        size_t total = 0;
+        while(block != NULL){
+            arenaBlock *previousBlock = block->previousBlock;
+            total += block->size;
+            free(block);
+            block = previousBlock;
+        }
+        block = newArenaBlock(total, NULL);
+        memory->current = block;
+    }
+    block->used = 0;
+}
+
+#ifndef SHELL_NO_MAIN
+int main(int argc, char *argv[])
+{
+    lineReader reader; /* buffered reader for the command stream */
+    commandLine lines[2]; /*parsed command lines, the current and the next one */
+    int current = 0;    /* slot of the line being executed */
+    int prefetched = 0; /* the other slot already holds the next line */
+
+    // Script file: run it from a mapping, stdin stays free for the commands it runs
+    if(argc > 1 && strcmp(argv[1], "-s") != 0){
+        if(initMappedLineReader(&reader, argv[1]) == -1){
+            exit(127);
+        }
+        batchMode = 1;
+    }
+    // Batch mode: -s or a command stream that is not a terminal
+    else if(argc > 1 || !isatty(STDIN_FILENO)){
+        batchMode = 1;
+        initLineReader(&reader, STDIN_FILENO, BATCH_READ_AHEAD_SIZE);
+        // Children must not read the commands buffered ahead of them
+        nullInputFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        shellPid = getpid();
+        clock_gettime(CLOCK_MONOTONIC, &batchStart);
+        atexit(reportBatchRate);
+    }else{
+        initLineReader(&reader, STDIN_FILENO, READ_AHEAD_SIZE);
+    }
+    initCommandLine(&lines[0]);
+    initCommandLine(&lines[1]);
+    initLexer();
+
+    // Child exits, Control<z> and Control<c> come from the event loop
+    initJobTable();
+    initEventLoop();
+    watchInput(reader.fd);
+    if(!batchMode && isatty(STDIN_FILENO)){
+        initJobControl();
+    }
+
+    // Map the bookmarks shared with other shells
+    initBookmarkStore();
+
+    // Typed commands are kept in the history, scripts and pipes are not
+    if(!batchMode){
+        initHistory();
+    }
+
+    // Read Path Variables and Fill Path Array
+    fillPath();
+
+
+    while (1){
+        // Reap background jobs that finished since the last prompt
+        notifyFinishedJobs();
+
+        if(prefetched){
+            // The next line was read while the previous command ran
+            current = 1 - current;
+            prefetched = 0;
+        }else{
+            // Print our shell to the screen and wait for the user input
+            if(!batchMode){
+                printf("myshell> ");
+                fflush(NULL);
+                atPrompt = 1;
+            }
+
+            int more = setup(&reader, &lines[current]);
+            atPrompt = 0;
+            if(more == 0){
+                exit(0);    /* ^d was entered */
+            }
+        }
+        commandLine *line = &lines[current];
+
+        // Empty line, or one that did not parse
+        if(line->pipelineCount == 0){
+            if(line->error[0] != '\0'){
+                fprintf(stderr, "%s\n", line->error);
+                lastExitStatus = 2;
+            }
+            continue;
+        }
+        commandsExecuted++;
+
+        if(line->pipelineCount == 1 && line->pipelines[0].stageCount == 1 && line->stages[0].planLength == 0
+           && strcmp(line->stages[0].args[0], "bookmark") == 0
+           && line->stages[0].args[1] != NULL && strcmp(line->stages[0].args[1], "-i") == 0 && line->stages[0].args[2] != NULL){
+            // Run a command, it was stored already parsed. Anywhere else the builtin runs it
+            int background = line->pipelines[0].background;
+            int index = atoi(line->stages[0].args[2]);
+            line->error[0] = '\0';
+            uint64_t start = phaseClock();
+            int loaded = loadBookmark(index, line, stdout);
+            recordPhase(PHASE_DISPATCH, start);
+            if(loaded == -1){
+                fprintf(stderr, "bookmark: no bookmark %d\n", index);
+                continue;
+            }
+            if(line->pipelineCount == 0){
+                if(line->error[0] != '\0'){
+                    fprintf(stderr, "%s\n", line->error);
+                }
+                continue;
+            }
+            line->pipelines[line->pipelineCount - 1].background |= background;
+        }
+
+        int endOfInput = 0;
+        for(int i = 0; i < line->pipelineCount; i++){
+            pipeline *next = &line->pipelines[i];
+            // && runs the pipeline only if the previous one succeeded
+            if(next->connector == CONNECT_AND && lastExitStatus != 0){
+                continue;
+            }
+
+            job *newJob = executePipeline(&line->stages[next->firstStage], next->stageCount, next->background);
+            if(newJob == NULL){
+                continue;
+            }
+
+            // In batch mode parse the next line while the last command of
+            // this one runs. The children have their own copy of this line,
+            // so its buffer may be reused now.
+            if(batchMode && newJob->background == 0 && i == line->pipelineCount - 1){
+                if(setup(&reader, &lines[1 - current]) == 0){
+                    endOfInput = 1;
+                }else{
+                    prefetched = 1;
+                }
+            }
+
+            uint64_t start = phaseClock();
+            parent_process(newJob);
+            recordPhase(PHASE_WAIT, start);
+            foreground = 0;
+        }
+        if(endOfInput){
+            exit(0);
+        }
+        /** the steps are:
+        (1) run a lone builtin in place, otherwise start every stage of the
+            pipeline with posix_spawn(), or fork() for builtin stages
+        (2) the child process runs the resolved executable
+        (3) if background == 0, the parent will wait,
+        otherwise it will invoke the setup() function again. */
+    }
+}
+#endif /* SHELL_NO_MAIN */
+
+/* Print the command rate of a batch run to stderr when the shell exits */
+void reportBatchRate() {
+    if(getpid() != shellPid){
+        return;     /* a forked builtin is exiting */
+    }
+    fflush(stdout);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = elapsedSeconds(&batchStart, &now);
+    fprintf(stderr, "%ld commands in %.3f s (%.0f commands/sec)\n", commandsExecuted, seconds,
+            seconds > 0 ? commandsExecuted / seconds : 0.0);
+}
+
+static bookmarkRecord *bookmarkRecords(bookmarkHeader *header) {
+    return (bookmarkRecord *)(header + 1);
+}
+
+static char *bookmarkText(bookmarkHeader *header, bookmarkRecord *record) {
+    return (char *)header + header->heapStart + record->offset;
+}
+
+/* Heap bytes taken by a bookmark: its text and the parsed form behind it */
+static size_t bookmarkSize(bookmarkRecord *record) {
+    return record->length + 1 + record->parsedLength;
+}
+
+/*
+ * Open the bookmark file in $HOME, creating it on first use. Nothing is read
+ * at startup beyond mapping it, lookups index the records directly. Without
+ * a usable home directory the bookmarks live in an anonymous file and last
+ * as long as this shell.
+ */
+void initBookmarkStore() {
+    initCommandLine(&bookmarkLine);
+    const char *home = getenv("HOME");
+    if(home != NULL && home[0] != '\0'){
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", home, BOOKMARK_FILE);
+        bookmarkFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    }
+    if(bookmarkFd == -1){
+        bookmarkFd = memfd_create("bookmarks", MFD_CLOEXEC);
+        if(bookmarkFd == -1){
+            perror("bookmarks");
+            return;
+        }
+    }
+
+    if(flock(bookmarkFd, LOCK_EX) == -1){
+        perror("bookmarks");
+        close(bookmarkFd);
+        bookmarkFd = -1;
+        return;
+    }
+    struct stat info;
+    if(fstat(bookmarkFd, &info) == 0 && info.st_size == 0){
+        // A new file: lay out an empty index and heap
+        size_t heapStart = sizeof(bookmarkHeader) + BOOKMARK_INITIAL_CAPACITY * sizeof(bookmarkRecord);
+        bookmarkHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BOOKMARK_MAGIC, sizeof(header.magic));
+        header.capacity = BOOKMARK_INITIAL_CAPACITY;
+        header.heapStart = heapStart;
+        if(ftruncate(bookmarkFd, heapStart + BOOKMARK_INITIAL_HEAP) == -1
+           || pwrite(bookmarkFd, &header, sizeof(header), 0) != sizeof(header)){
+            perror("bookmarks");
+        }
+    }
+    bookmarkHeader *header = lockBookmarks(LOCK_EX);
+    if(header != NULL && memcmp(header->magic, BOOKMARK_MAGIC, sizeof(header->magic)) != 0){
+        fprintf(stderr, "bookmarks: %s/%s is not a bookmark file\n", home, BOOKMARK_FILE);
+        header = NULL;
+    }
+    unlockBookmarks();
+    if(header == NULL){
+        if(bookmarkMap != NULL){
+            munmap(bookmarkMap, bookmarkMapSize);
+            bookmarkMap = NULL;
+        }
+        close(bookmarkFd);
+        bookmarkFd = -1;
+    }
+}
+
+/* Make the mapping cover the whole file, another shell may have grown it */
+static int mapBookmarks() {
+    struct stat info;
+    if(fstat(bookmarkFd, &info) == -1 || (size_t)info.st_size < sizeof(bookmarkHeader)){
+        return -1;
+    }
+    if(bookmarkMap != NULL && bookmarkMapSize == (size_t)info.st_size){
+        return 0;
+    }
+    void *map;
+    if(bookmarkMap == NULL){
+        map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, bookmarkFd, 0);
+    }else{
+        map = mremap(bookmarkMap, bookmarkMapSize, info.st_size, MREMAP_MAYMOVE);
+    }
+    if(map == MAP_FAILED){
+        perror("bookmarks");
+        return -1;
+    }
+    bookmarkMap = map;
+    bookmarkMapSize = info.st_size;
+    return 0;
+}
+
+/* flock() the store with LOCK_SH or LOCK_EX, returns NULL if bookmarks are unavailable */
+bookmarkHeader *lockBookmarks(int operation) {
+    if(bookmarkFd == -1){
+        return NULL;
+    }
+    while(flock(bookmarkFd, operation) == -1){
+        if(errno != EINTR){
+            perror("bookmarks");
+            return NULL;
+        }
+    }
+    if(mapBookmarks() == -1){
+        flock(bookmarkFd, LOCK_UN);
+        return NULL;
+    }
+    return (bookmarkHeader *)bookmarkMap;
+}
+
+void unlockBookmarks() {
+    if(bookmarkFd != -1){
+        flock(bookmarkFd, LOCK_UN);
+    }
+}
+
+/* Grow the file to at least size bytes, the header pointer changes */
+static bookmarkHeader *growBookmarkFile(size_t size) {
+    if(size <= bookmarkMapSize){
+        return (bookmarkHeader *)bookmarkMap;
+    }
+    if(size < bookmarkMapSize * 2){
+        size = bookmarkMapSize * 2;
+    }
+    if(ftruncate(bookmarkFd, size) == -1 || mapBookmarks() == -1){
+        perror("bookmarks");
+        return NULL;
+    }
+    return (bookmarkHeader *)bookmarkMap;
+}
+
+/* Pack the text of the remaining bookmarks to the start of the heap */
+static void compactBookmarks(bookmarkHeader *header) {
+    bookmarkRecord *records = bookmarkRecords(header);
+    char *packed = malloc(header->heapUsed - header->heapGarbage + 1);
+    if(packed == NULL){
+        return;
+    }
+    uint64_t used = 0;
+    for(uint32_t i = 0; i < header->count; i++){
+        memcpy(packed + used, bookmarkText(header, &records[i]), bookmarkSize(&records[i]));
+        records[i].offset = used;
+        used += bookmarkSize(&records[i]);
+    }
+    memcpy((char *)header + header->heapStart, packed, used);
+    free(packed);
+    header->heapUsed = used;
+    header->heapGarbage = 0;
+}
+
+void addNewBookmark(const char *command){
+    // Parse a copy now so running the bookmark does not have to
+    resetCommandLine(&bookmarkLine);
+    char *copy = arenaCopy(&bookmarkLine.memory, command);
+    if(lexLine(copy, &bookmarkLine) == -1 || parseCommandLine(&bookmarkLine) == -1){
+        fprintf(stderr, "bookmark: %s\n", bookmarkLine.error);
+        return;
+    }
+    if(bookmarkLine.pipelineCount == 0){
+        fprintf(stderr, "bookmark: empty command\n");
+        return;
+    }
+    size_t length = strlen(command);
+    size_t parsedLength = saveCommandLine(&bookmarkLine, NULL);
+    size_t size = length + 1 + parsedLength;
+
+    bookmarkHeader *header = lockBookmarks(LOCK_EX);
+    if(header == NULL){
+        unlockBookmarks();
+        return;
+    }
+    if(header->count == header->capacity){
+        // Double the index, the text moves up behind it
+        size_t extra = header->capacity * sizeof(bookmarkRecord);
+        header = growBookmarkFile(header->heapStart + header->heapUsed + extra);
+        if(header == NULL){
+            unlockBookmarks();
+            return;
+        }
+        memmove((char *)header + header->heapStart + extra, (char *)header + header->heapStart, header->heapUsed);
+        header->heapStart += extra;
+        header->capacity *= 2;
+    }
+    if(header->heapStart + header->heapUsed + size > bookmarkMapSize && header->heapGarbage > 0){
+        compactBookmarks(header);
+    }
+    header = growBookmarkFile(header->heapStart + header->heapUsed + size);
+    if(header == NULL){
+        unlockBookmarks();
+        return;
+    }
+    bookmarkRecord *record = &bookmarkRecords(header)[header->count];
+    record->offset = header->heapUsed;
+    record->length = length;
+    record->parsedLength = parsedLength;
+    memcpy(bookmarkText(header, record), command, length + 1);
+    saveCommandLine(&bookmarkLine, bookmarkText(header, record) + length + 1);
+    header->heapUsed += size;
+    header->count++;
+    unlockBookmarks();
+}
+
+void deleteBookmark(int index){
+    bookmarkHeader *header = lockBookmarks(LOCK_EX);
+    if(header == NULL || index < 0 || (uint32_t)index >= header->count){
+        unlockBookmarks();
+        fprintf(stderr, "bookmark: no bookmark to delete\n");
+        return;
+    }
+    bookmarkRecord *records = bookmarkRecords(header);
+    header->heapGarbage += bookmarkSize(&records[index]);
+    // later bookmarks move down one number, like the list they replace
+    memmove(&records[index], &records[index + 1], (header->count - index - 1) * sizeof(bookmarkRecord));
+    header->count--;
+    if(header->count == 0){
+        header->heapUsed = 0;
+        header->heapGarbage = 0;
+    }
+    unlockBookmarks();
+}
+
+void listBookmarks(){
+    bookmarkHeader *header = lockBookmarks(LOCK_SH);
+    if(header != NULL){
+        bookmarkRecord *records = bookmarkRecords(header);
+        for(uint32_t i = 0; i < header->count; i++){
+            printf("%u \"%s\"\n", i, bookmarkText(header, &records[i]));
+        }
+    }
+    unlockBookmarks();
+}
+
+/*
+ * Print bookmark number index to echo and load it into line, straight from
+ * its parsed form. Returns -1 if there is no such bookmark.
+ */
+int loadBookmark(int index, commandLine *line, FILE *echo) {
+    int result = -1;
+    bookmarkHeader *header = lockBookmarks(LOCK_SH);
+    if(header != NULL && index >= 0 && (uint32_t)index < header->count){
+        bookmarkRecord *record = &bookmarkRecords(header)[index];
+        char *text = bookmarkText(header, record);
+        fprintf(echo, "%s\n", text);
+        result = 0;
+        if(record->parsedLength > 0){
+            loadCommandLine(line, text + record->length + 1);
+        }else{
+            // stored by a shell that kept only the text
+            if(lexLine(arenaCopy(&line->memory, text), line) == -1 || parseCommandLine(line) == -1){
+                line->pipelineCount = 0;
+            }
+        }
+    }
+    unlockBookmarks();
+    return result;
+}
+
+/*
+ * Write the parsed form of line to out, or only measure it when out is NULL.
+ * Returns its size in bytes.
+ */
+size_t saveCommandLine(commandLine *line, char *out) {
+    savedCommandLine saved;
+    saved.pipelineCount = line->pipelineCount;
+    saved.stageCount = line->stageCount;
+    saved.operationCount = 0;
+    saved.argCount = line->args.count;
+    saved.poolLength = 0;
+    for(int i = 0; i < line->args.count; i++){
+        if(line->args.items[i] != NULL){
+            saved.poolLength += strlen(line->args.items[i]) + 1;
+        }
+    }
+    for(int i = 0; i < line->stageCount; i++){
+        saved.operationCount += line->stages[i].planLength;
+        for(int k = 0; k < line->stages[i].planLength; k++){
+            if(line->stages[i].plan[k].file != NULL){
+                saved.poolLength += strlen(line->stages[i].plan[k].file) + 1;
+            }
+        }
+    }
+    size_t pipelinesLength = saved.pipelineCount * sizeof(pipeline);
+    size_t stagesLength = saved.stageCount * sizeof(savedStage);
+    size_t operationsLength = saved.operationCount * sizeof(savedOperation);
+    size_t argsLength = saved.argCount * sizeof(int32_t);
+    size_t size = sizeof(saved) + pipelinesLength + stagesLength + operationsLength + argsLength + saved.poolLength;
+    if(out == NULL){
+        return size;
+    }
+
+    char *stages = out + sizeof(saved) + pipelinesLength;
+    char *operations = stages + stagesLength;
+    char *args = operations + operationsLength;
+    char *pool = args + argsLength;
+    int32_t used = 0;
+    int32_t operationCount = 0;
+    memcpy(out, &saved, sizeof(saved));
+    memcpy(out + sizeof(saved), line->pipelines, pipelinesLength);
+    for(int i = 0; i < line->args.count; i++){
+        int32_t offset = -1;
+        if(line->args.items[i] != NULL){
+            size_t length = strlen(line->args.items[i]) + 1;
+            memcpy(pool + used, line->args.items[i], length);
+            offset = used;
+            used += length;
+        }
+        memcpy(args + i * sizeof(int32_t), &offset, sizeof(offset));
+    }
+    for(int i = 0; i < line->stageCount; i++){
+        savedStage stage;
+        stage.argStart = line->stages[i].args - line->args.items;
+        stage.planStart = operationCount;
+        stage.planLength = line->stages[i].planLength;
+        memcpy(stages + i * sizeof(savedStage), &stage, sizeof(stage));
+        for(int k = 0; k < line->stages[i].planLength; k++){
+            fdOperation *step = &line->stages[i].plan[k];
+            savedOperation operation = {step->operation, step->fd, step->source, step->flags, -1};
+            if(step->file != NULL){
+                size_t length = strlen(step->file) + 1;
+                memcpy(pool + used, step->file, length);
+                operation.file = used;
+                used += length;
+            }
+            memcpy(operations + operationCount++ * sizeof(savedOperation), &operation, sizeof(operation));
+        }
+    }
+    return size;
+}
+
+/* Rebuild a line from its parsed form, only copying and fixing up pointers */
+int loadCommandLine(commandLine *line, const char *data) {
+    savedCommandLine saved;
+    memcpy(&saved, data, sizeof(saved));
+    const char *stages = data + sizeof(saved) + saved.pipelineCount * sizeof(pipeline);
+    const char *operations = stages + saved.stageCount * sizeof(savedStage);
+    const char *args = operations + saved.operationCount * sizeof(savedOperation);
+    char *pool = arenaAllocate(&line->memory, saved.poolLength);
+    memcpy(pool, args + saved.argCount * sizeof(int32_t), saved.poolLength);
+
+    line->pipelines = arenaAllocate(&line->memory, saved.pipelineCount * sizeof(pipeline));
+    memcpy(line->pipelines, data + sizeof(saved), saved.pipelineCount * sizeof(pipeline));
+    line->pipelineCount = line->pipelineCapacity = saved.pipelineCount;
+
+    line->args.items = arenaAllocate(&line->memory, saved.argCount * sizeof(char *));
+    line->args.count = line->args.capacity = saved.argCount;
+    for(uint32_t i = 0; i < saved.argCount; i++){
+        int32_t offset;
+        memcpy(&offset, args + i * sizeof(int32_t), sizeof(offset));
+        line->args.items[i] = offset == -1 ? NULL : pool + offset;
+    }
+
+    line->operations = arenaAllocate(&line->memory, saved.operationCount * sizeof(fdOperation));
+    line->operationCount = line->operationCapacity = saved.operationCount;
+    for(uint32_t i = 0; i < saved.operationCount; i++){
+        savedOperation operation;
+        memcpy(&operation, operations + i * sizeof(savedOperation), sizeof(operation));
+        line->operations[i].operation = operation.operation;
+        line->operations[i].fd = operation.fd;
+        line->operations[i].source = operation.source;
+        line->operations[i].flags = operation.flags;
+        line->operations[i].file = operation.file == -1 ? NULL : pool + operation.file;
+    }
+
+    line->stages = arenaAllocate(&line->memory, saved.stageCount * sizeof(pipelineStage));
+    line->stageCount = line->stageCapacity = saved.stageCount;
+    for(uint32_t i = 0; i < saved.stageCount; i++){
+        savedStage stage;
+        memcpy(&stage, stages + i * sizeof(savedStage), sizeof(stage));
+        line->stages[i].args = &line->args.items[stage.argStart];
+        line->stages[i].plan = &line->operations[stage.planStart];
+        line->stages[i].planLength = stage.planLength;
+    }
+    line->tokenCount = 0;
+    return 0;
+}
+
+/*
+ * Attach to the history shared by every shell of this user. The ring and
+ * its counters live in a shared mapping of ~/.myshell_history.ring, the
+ * log and its offset index are written at positions claimed in the ring,
+ * so adding an entry takes no lock. The lock on the ring file only guards
+ * creating it. Without a home directory the ring is anonymous and only
+ * shared with this shell's children.
+ */
+void initHistory() {
+    const char *home = getenv("HOME");
+    int ringFd = -1;
+    if(home != NULL && home[0] != '\0'){
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
+        historyLogFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        snprintf(path, sizeof(path), "%s/%s", home, HISTORY_INDEX_FILE);
+        historyIndexFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        snprintf(path, sizeof(path), "%s/%s", home, HISTORY_RING_FILE);
+        ringFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if(historyLogFd == -1 || historyIndexFd == -1 || ringFd == -1){
+            perror("history");
+            if(historyLogFd != -1) close(historyLogFd);
+            if(historyIndexFd != -1) close(historyIndexFd);
+            if(ringFd != -1) close(ringFd);
+            historyLogFd = historyIndexFd = ringFd = -1;
+        }
+    }
+
+    if(ringFd == -1){
+        historyShared = mmap(NULL, sizeof(historyRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(historyShared == MAP_FAILED){
+            historyShared = NULL;
+        }
+        return;
+    }
+
+    flock(ringFd, LOCK_EX);
+    struct stat info;
+    int created = fstat(ringFd, &info) == 0 && (size_t)info.st_size < sizeof(historyRing);
+    if(created && ftruncate(ringFd, sizeof(historyRing)) == -1){
+        perror("history");
+    }
+    historyShared = mmap(NULL, sizeof(historyRing), PROT_READ | PROT_WRITE, MAP_SHARED, ringFd, 0);
+    if(historyShared == MAP_FAILED){
+        perror("history");
+        historyShared = NULL;
+    }else if(created || memcmp(historyShared->magic, HISTORY_MAGIC, sizeof(historyShared->magic)) != 0){
+        // First shell to use the history: number the entries already in the log
+        memset(historyShared, 0, sizeof(historyRing));
+        syncHistory();
+        historyShared->head = rebuildHistoryIndex();
+        historyShared->logEnd = historyLogSize;
+        memcpy(historyShared->magic, HISTORY_MAGIC, sizeof(historyShared->magic));
+    }
+    flock(ringFd, LOCK_UN);
+    close(ringFd);
+    syncHistory();
+}
+
+/* Entries added so far, by any shell, and the number of the next one */
+long historyEntries() {
+    return historyShared == NULL ? 0 : (long)__atomic_load_n(&historyShared->head, __ATOMIC_ACQUIRE);
+}
+
+/* Remap one of the history files if it has grown since it was mapped */
+static void *remapHistoryFile(int fd, void *map, size_t *mapSize) {
+    struct stat info;
+    if(fstat(fd, &info) == -1 || (size_t)info.st_size == *mapSize){
+        return map;
+    }
+    if(map != NULL){
+        munmap(map, *mapSize);
+        map = NULL;
+    }
+    *mapSize = 0;
+    if(info.st_size > 0){
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(map == MAP_FAILED){
+            perror("history");
+            return NULL;
+        }
+        *mapSize = info.st_size;
+    }
+    return map;
+}
+
+/* Map whatever this and other shells have written to the files since the last call */
+void syncHistory() {
+    if(historyLogFd == -1){
+        return;
+    }
+    historyLog = remapHistoryFile(historyLogFd, historyLog, &historyLogSize);
+    historyIndex = remapHistoryFile(historyIndexFd, historyIndex, &historyIndexSize);
+}
+
+/* Recreate the offset index from the log, returns the number of entries */
+long rebuildHistoryIndex() {
+    uint64_t offsets[512];
+    int buffered = 0;
+    long entries = 0;
+    if(historyLogFd == -1 || ftruncate(historyIndexFd, 0) == -1){
+        return 0;
+    }
+    for(size_t offset = 0; offset < historyLogSize;){
+        const char *end = memchr(historyLog + offset, '\n', historyLogSize - offset);
+        offsets[buffered++] = offset + 1;
+        if(buffered == 512 || end == NULL || (size_t)(end - historyLog) + 1 >= historyLogSize){
+            if(pwrite(historyIndexFd, offsets, buffered * sizeof(uint64_t), entries * sizeof(uint64_t)) == -1){
+                perror("history");
+                return 0;
+            }
+            entries += buffered;
+            buffered = 0;
+        }
+        if(end == NULL){
+            break;
+        }
+        offset = end - historyLog + 1;
+    }
+    syncHistory();
+    return entries;
+}
+
+/*
+ * Record a line as typed, before the lexer takes it apart. The entry number
+ * and the log space are claimed with atomic adds, then the ring slot is
+ * published like a seqlock: an odd sequence while it is written, the even
+ * one for this entry once it is complete.
+ */
+void addHistory(const char *text) {
+    size_t length = strlen(text);
+    if(historyShared == NULL || strspn(text, " \t") == length){
+        return;
+    }
+    uint64_t number = __atomic_fetch_add(&historyShared->head, 1, __ATOMIC_ACQ_REL);
+    historySlot *slot = &historyShared->slots[number & (HISTORY_RING_SIZE - 1)];
+    __atomic_store_n(&slot->sequence, number * 2 + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->length = length;
+    memcpy(slot->text, text, length < HISTORY_SLOT_TEXT ? length : HISTORY_SLOT_TEXT);
+    __atomic_store_n(&slot->sequence, number * 2 + 2, __ATOMIC_RELEASE);
+
+    if(historyLogFd != -1){
+        // The log line goes first, an index entry always points at complete text
+        uint64_t offset = __atomic_fetch_add(&historyShared->logEnd, length + 1, __ATOMIC_RELAXED);
+        struct iovec parts[2] = {{(void *)text, length}, {"\n", 1}};
+        uint64_t entry = offset + 1;
+        if(pwritev(historyLogFd, parts, 2, offset) != (ssize_t)length + 1
+           || pwrite(historyIndexFd, &entry, sizeof(entry), number * sizeof(uint64_t)) != sizeof(entry)){
+            perror("history");
+        }
+    }
+}
+
+/* Entry number was claimed but its writer has not finished it */
+static int historyPending(long number) {
+    historySlot *slot = &historyShared->slots[number & (HISTORY_RING_SIZE - 1)];
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == (uint64_t)number * 2 + 1;
+}
+
+/*
+ * Text of history entry number, from the shared ring or else from the log.
+ * It is not null terminated and stays valid until the next call.
+ */
+const char *historyText(long number, size_t *length) {
+    static char copy[HISTORY_SLOT_TEXT];
+    if(historyShared == NULL || number < 0){
+        return NULL;
+    }
+    historySlot *slot = &historyShared->slots[number & (HISTORY_RING_SIZE - 1)];
+    uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    uint32_t slotLength = slot->length;
+    if(sequence == (uint64_t)number * 2 + 2 && slotLength <= HISTORY_SLOT_TEXT){
+        memcpy(copy, slot->text, slotLength);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // a writer that came around the ring meanwhile makes the copy useless
+        if(__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence){
+            *length = slotLength;
+            return copy;
+        }
+    }
+
+    if(historyLogFd == -1){
+        return NULL;
+    }
+    if((size_t)number >= historyIndexSize / sizeof(uint64_t)){
+        syncHistory();
+        if((size_t)number >= historyIndexSize / sizeof(uint64_t)){
+            return NULL;
+        }
+    }
+    uint64_t offset = historyIndex[number];
+    if(offset == 0){
+        return NULL;    /* still being written */
+    }
+    offset--;
+    if(offset >= historyLogSize){
+        syncHistory();
+        if(offset >= historyLogSize){
+            return NULL;
+        }
+    }
+    const char *end = memchr(historyLog + offset, '\n', historyLogSize - offset);
+    *length = (end == NULL ? historyLog + historyLogSize : end) - (historyLog + offset);
+    return historyLog + offset;
+}
+
+static void printHistoryEntry(long number) {
+    size_t length;
+    const char *text = historyText(number, &length);
+    if(text != NULL){
+        printf("%5ld  %.*s\n", number, (int)length, text);
+    }
+}
+
+static trigramPosting *findTrigram(uint32_t trigram) {
+    if(trigramTableSize == 0){
+        return NULL;
+    }
+    size_t mask = trigramTableSize - 1;
+    for(size_t i = (trigram * 2654435761u) & mask; ; i = (i + 1) & mask){
+        if(trigramTable[i].trigram == trigram){
+            return &trigramTable[i];
+        }
+        if(trigramTable[i].trigram == 0){
+            return NULL;
+        }
+    }
+}
+
+static trigramPosting *insertTrigram(uint32_t trigram) {
+    if((trigramTableUsed + 1) * 2 > trigramTableSize){
+        trigramPosting *old = trigramTable;
+        size_t oldSize = trigramTableSize;
+        trigramTableSize = oldSize == 0 ? TRIGRAM_TABLE_INITIAL_SIZE : oldSize * 2;
+        trigramTable = calloc(trigramTableSize, sizeof(trigramPosting));
+        for(size_t i = 0; i < oldSize; i++){
+            if(old[i].trigram != 0){
+                size_t mask = trigramTableSize - 1;
+                size_t slot = (old[i].trigram * 2654435761u) & mask;
+                while(trigramTable[slot].trigram != 0){
+                    slot = (slot + 1) & mask;
+                }
+                trigramTable[slot] = old[i];
+            }
+        }
+        free(old);
+    }
+    size_t mask = trigramTableSize - 1;
+    size_t slot = (trigram * 2654435761u) & mask;
+    while(trigramTable[slot].trigram != 0){
+        slot = (slot + 1) & mask;
+    }
+    trigramTable[slot].trigram = trigram;
+    trigramTableUsed++;
+    return &trigramTable[slot];
+}
+
+static uint32_t trigramAt(const char *text) {
+    return (uint32_t)(unsigned char)text[0] << 16 | (uint32_t)(unsigned char)text[1] << 8 | (unsigned char)text[2];
+}
+
+/*
+ * Add the history entries not indexed yet to the trigram index. A new shell
+ * starts from the snapshot file, and rewrites it once the entries indexed
+ * past it are a fair share of those in it.
+ */
+void indexHistory() {
+    if(!trigramLoaded){
+        loadTrigramIndex();
+    }
+    long entries = historyEntries();
+    for(; trigramIndexed < entries; trigramIndexed++){
+        size_t length;
+        const char *text = historyText(trigramIndexed, &length);
+        if(text == NULL && historyPending(trigramIndexed)){
+            break;      /* index it once its writer is done */
+        }
+        for(size_t i = 0; text != NULL && i + 3 <= length; i++){
+            uint32_t trigram = trigramAt(&text[i]);
+            trigramPosting *posting = findTrigram(trigram);
+            if(posting == NULL){
+                posting = insertTrigram(trigram);
+            }
+            // entries are indexed in order, so each list stays sorted
+            if(posting->count > 0 && posting->entries[posting->count - 1] == (uint32_t)trigramIndexed){
+                continue;
+            }
+            if(posting->count == posting->capacity){
+                posting->capacity = posting->capacity == 0 ? 4 : posting->capacity * 2;
+                posting->entries = realloc(posting->entries, posting->capacity * sizeof(uint32_t));
+            }
+            posting->entries[posting->count++] = trigramIndexed;
+        }
+    }
+    long unsaved = trigramIndexed - trigramSaved;
+    if(unsaved >= TRIGRAM_SAVE_MIN && unsaved * TRIGRAM_SAVE_SHARE >= trigramIndexed){
+        saveTrigramIndex();
+    }
+}
+
+static int historyFilePath(char *path, size_t size, const char *name) {
+    const char *home = getenv("HOME");
+    if(historyLogFd == -1 || home == NULL || home[0] == '\0'){
+        return -1;
+    }
+    return snprintf(path, size, "%s/%s", home, name) < (int)size ? 0 : -1;
+}
+
+/*
+ * Take the index of the entries some shell already indexed from the
+ * snapshot file. Its lists are used where they are mapped, so only the
+ * entries added since are indexed here. A snapshot of another log (one
+ * rebuilt since) or a damaged one is ignored.
+ */
+void loadTrigramIndex() {
+    trigramLoaded = 1;
+    char path[4096];
+    if(historyFilePath(path, sizeof(path), HISTORY_TRIGRAM_FILE) == -1){
+        return;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+        return;
+    }
+    struct stat info;
+    const char *map = MAP_FAILED;
+    if(fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(trigramSnapshot)){
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if(map == MAP_FAILED){
+        return;
+    }
+    size_t size = info.st_size;
+    trigramSnapshot header;
+    memcpy(&header, map, sizeof(header));
+    int valid = memcmp(header.magic, TRIGRAM_MAGIC, sizeof(header.magic)) == 0 && header.covered > 0
+                && header.covered <= (uint64_t)historyEntries()
+                && header.trigramCount <= (size - sizeof(header)) / sizeof(trigramRecord);
+    if(valid){
+        syncHistory();
+        valid = header.covered <= historyIndexSize / sizeof(uint64_t) && historyIndex[header.covered - 1] == header.lastOffset;
+    }
+    const trigramRecord *records = (const trigramRecord *)(map + sizeof(header));
+    for(uint64_t i = 0; valid && i < header.trigramCount; i++){
+        valid = records[i].trigram != 0 && records[i].offset % sizeof(uint32_t) == 0 && records[i].offset <= size
+                && records[i].count <= (size - records[i].offset) / sizeof(uint32_t);
+    }
+    if(!valid){
+        munmap((void *)map, size);
+        return;
+    }
+    // The mapping stays for the life of the shell, a newer snapshot replaces the file, not its pages
+    for(uint64_t i = 0; i < header.trigramCount; i++){
+        trigramPosting *posting = insertTrigram(records[i].trigram);
+        posting->saved = (const uint32_t *)(map + records[i].offset);
+        posting->savedCount = records[i].count;
+    }
+    trigramIndexed = trigramSaved = header.covered;
+}
+
+static int compareTrigramRecords(const void *first, const void *second) {
+    uint32_t a = ((const trigramRecord *)first)->trigram;
+    uint32_t b = ((const trigramRecord *)second)->trigram;
+    return a < b ? -1 : a > b;
+}
+
+/* Write the whole index to a new snapshot file and rename it over the old one */
+void saveTrigramIndex() {
+    char path[4096];
+    char temporary[4096 + 8];
+    if(historyFilePath(path, sizeof(path), HISTORY_TRIGRAM_FILE) == -1){
+        return;
+    }
+    syncHistory();
+    if((size_t)trigramIndexed > historyIndexSize / sizeof(uint64_t) || historyIndex[trigramIndexed - 1] == 0){
+        return;     /* the log index of the last entry is not written yet */
+    }
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    int fd = mkostemp(temporary, O_CLOEXEC);
+    if(fd == -1){
+        return;
+    }
+    trigramRecord *records = malloc(trigramTableUsed * sizeof(trigramRecord) + 1);
+    size_t count = 0;
+    for(size_t i = 0; i < trigramTableSize; i++){
+        if(trigramTable[i].trigram != 0){
+            trigramRecord record = {trigramTable[i].trigram, trigramTable[i].savedCount + trigramTable[i].count, 0};
+            records[count++] = record;
+        }
+    }
+    qsort(records, count, sizeof(trigramRecord), compareTrigramRecords);
+    uint64_t offset = sizeof(trigramSnapshot) + count * sizeof(trigramRecord);
+    for(size_t i = 0; i < count; i++){
+        records[i].offset = offset;
+        offset += records[i].count * sizeof(uint32_t);
+    }
+    trigramSnapshot header;
+    memcpy(header.magic, TRIGRAM_MAGIC, sizeof(header.magic));
+    header.covered = trigramIndexed;
+    header.lastOffset = historyIndex[trigramIndexed - 1];
+    header.trigramCount = count;
+
+    FILE *out = fdopen(fd, "w");
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(records, sizeof(trigramRecord), count, out);
+    for(size_t i = 0; i < count; i++){
+        trigramPosting *posting = findTrigram(records[i].trigram);
+        fwrite(posting->saved, sizeof(uint32_t), posting->savedCount, out);
+        fwrite(posting->entries, sizeof(uint32_t), posting->count, out);
+    }
+    int failed = ferror(out);
+    failed |= fclose(out) != 0;
+    if(failed || rename(temporary, path) == -1){
+        unlink(temporary);
+    }else{
+        trigramSaved = trigramIndexed;
+    }
+    free(records);
+}
+
+/* Entry number is in the list of posting, the mapped part or the one built here */
+static int postingHas(trigramPosting *posting, uint32_t number) {
+    return (posting->savedCount > 0 && bsearch(&number, posting->saved, posting->savedCount, sizeof(uint32_t),
+                                               compareEntryNumbers) != NULL)
+           || (posting->count > 0 && bsearch(&number, posting->entries, posting->count, sizeof(uint32_t),
+                                             compareEntryNumbers) != NULL);
+}
+
+/*
+ * Print the history entries containing pattern. Patterns of three or more
+ * bytes only look at the entries that have all of its trigrams, walking the
+ * shortest posting list and checking the others by binary search.
+ */
+void searchHistory(const char *pattern) {
+    size_t patternLength = strlen(pattern);
+    syncHistory();
+    long entries = historyEntries();
+    long first = historyLogFd == -1 && entries > HISTORY_RING_SIZE ? entries - HISTORY_RING_SIZE : 0;
+    if(patternLength < 3){
+        for(long number = first; number < entries; number++){
+            size_t length;
+            const char *text = historyText(number, &length);
+            if(text != NULL && memmem(text, length, pattern, patternLength) != NULL){
+                printHistoryEntry(number);
+            }
+        }
+        return;
+    }
+
+    indexHistory();
+    int trigramCount = patternLength - 2;
+    trigramPosting *postings[trigramCount];
+    int shortest = 0;
+    for(int i = 0; i < trigramCount; i++){
+        postings[i] = findTrigram(trigramAt(&pattern[i]));
+        if(postings[i] == NULL){
+            return;     /* some trigram never occurs */
+        }
+        if(postings[i]->savedCount + postings[i]->count < postings[shortest]->savedCount + postings[shortest]->count){
+            shortest = i;
+        }
+    }
+    trigramPosting *walk = postings[shortest];
+    for(uint32_t k = 0; k < walk->savedCount + walk->count; k++){
+        uint32_t number = k < walk->savedCount ? walk->saved[k] : walk->entries[k - walk->savedCount];
+        int candidate = number >= first;
+        for(int i = 0; candidate && i < trigramCount; i++){
+            if(i != shortest){
+                candidate = postingHas(postings[i], number);
+            }
+        }
+        size_t length;
+        const char *text = candidate ? historyText(number, &length) : NULL;
+        if(text != NULL && memmem(text, length, pattern, patternLength) != NULL){
+            printHistoryEntry(number);
+        }
+    }
+}
+
+int compareEntryNumbers(const void *first, const void *second) {
+    uint32_t a = *(const uint32_t *)first;
+    uint32_t b = *(const uint32_t *)second;
+    return a < b ? -1 : a > b;
+}
+
+/* Print the last count entries, at most the ring's worth without a log */
+void listHistory(long count) {
+    syncHistory();
+    long entries = historyEntries();
+    long first = entries - count;
+    if(first < 0){
+        first = 0;
+    }
+    for(long number = first; number < entries; number++){
+        printHistoryEntry(number);
+    }
+}
+
+/* bookmark -h: store history entry number as a new bookmark */
+void promoteHistory(long number) {
+    syncHistory();
+    size_t length;
+    const char *text = historyText(number, &length);
+    if(text == NULL){
+        fprintf(stderr, "bookmark: no history entry %ld\n", number);
+        return;
+    }
+    char *command = strndup(text, length);
+    addNewBookmark(command);
+    free(command);
+}
+
+/*
+ * Build the PATH lookup table. Only the directory list is read here, command
+ * names are resolved lazily by lookupPath() and remembered in the table
+ * together with the names that could not be found.
+ */
+void fillPath() {
+    clearPathTable();
+    for(int i = 0; i < pathDirectoryCount; i++){
+        free(pathDirectories[i].name);
+    }
+    free(pathDirectories);
+    free(pathSnapshot);
+    pathDirectories = NULL;
+    pathDirectoryCount = 0;
+
+    const char *path = getenv("PATH");
+    pathSnapshot = strdup(path == NULL ? "" : path);
+
+    int capacity = 1;
+    for(const char *c = pathSnapshot; *c; c++){
+        if(*c == ':') capacity++;
+    }
+    pathDirectories = calloc(capacity, sizeof(pathDirectory));
+
+    char *copy = strdup(pathSnapshot);
+    char *savePointer;
+    char *token = strtok_r(copy, ":", &savePointer);
+    while(token != NULL){
+        struct stat info;
+        pathDirectory *directory = &pathDirectories[pathDirectoryCount++];
+        directory->name = strdup(token);
+        if(stat(token, &info) == 0){
+            directory->mtime = info.st_mtim;
+        }
+        token = strtok_r(NULL, ":", &savePointer);
+    }
+    free(copy);
+    pathCheckedAt = phaseClock();
+
+    if(pathTable == NULL){
+        pathTableSize = PATH_TABLE_INITIAL_SIZE;
+        pathTable = calloc(pathTableSize, sizeof(pathEntry));
+    }
+}
+
+static size_t hashName(const char *name) {
+    // FNV-1a
+    size_t hash = 2166136261u;
+    while(*name){
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+pathEntry *findPathEntry(const char *name) {
+    size_t mask = pathTableSize - 1;
+    size_t slot = hashName(name) & mask;
+    while(pathTable[slot].name != NULL && strcmp(pathTable[slot].name, name) != 0){
+        slot = (slot + 1) & mask;
+    }
+    return &pathTable[slot];
+}
+
+void insertPathEntry(char *name, char *path, int dirIndex, int hits) {
+    // Keep the load factor under 1/2 so probes stay short
+    if((pathTableUsed + 1) * 2 > pathTableSize){
+        pathEntry *old = pathTable;
+        size_t oldSize = pathTableSize;
+        pathTableSize *= 2;
+        pathTable = calloc(pathTableSize, sizeof(pathEntry));
+        pathTableUsed = 0;
+        for(size_t i = 0; i < oldSize; i++){
+            if(old[i].name != NULL){
+                insertPathEntry(old[i].name, old[i].path, old[i].dirIndex, old[i].hits);
+            }
+        }
+        free(old);
+    }
+    pathEntry *entry = findPathEntry(name);
+    entry->name = name;
+    entry->path = path;
+    entry->dirIndex = dirIndex;
+    entry->hits = hits;
+    pathTableUsed++;
+}
+
+void clearPathTable() {
+    for(size_t i = 0; i < pathTableSize; i++){
+        free(pathTable[i].name);
+        free(pathTable[i].path);
+        pathTable[i].name = NULL;
+        pathTable[i].path = NULL;
+    }
+    pathTableUsed = 0;
+}
+
+/*
+ * Remove every entry that a change in the given directory could have made
+ * stale: names found there or in a later directory (a new file may now
+ * shadow them) and all negative entries.
+ */
+void dropPathEntries(int fromDirectory) {
+    size_t size = pathTableSize;
+    pathEntry *old = pathTable;
+    pathTable = calloc(size, sizeof(pathEntry));
+    pathTableUsed = 0;
+    for(size_t i = 0; i < size; i++){
+        if(old[i].name == NULL){
+            continue;
+        }
+        if(old[i].dirIndex >= fromDirectory){
+            free(old[i].name);
+            free(old[i].path);
+        }else{
+            insertPathEntry(old[i].name, old[i].path, old[i].dirIndex, old[i].hits);
+        }
+    }
+    free(old);
+}
+
+/*
+ * Drop the entries a change of PATH or of one of its directories made
+ * stale. The directories are only stat()ed once PATH_CHECK_INTERVAL_NS has
+ * passed or a failed spawn cleared pathCheckedAt, so a lookup, hit or miss,
+ * costs no system call.
+ */
+void validatePath() {
+    const char *path = getenv("PATH");
+    if(path == NULL) path = "";
+    if(pathSnapshot == NULL || strcmp(path, pathSnapshot) != 0){
+        fillPath();
+        return;
+    }
+    uint64_t now = phaseClock();
+    if(pathCheckedAt != 0 && now - pathCheckedAt < PATH_CHECK_INTERVAL_NS){
+        return;
+    }
+    pathCheckedAt = now;
+    int firstChanged = -1;
+    for(int i = 0; i < pathDirectoryCount; i++){
+        struct stat info;
+        struct timespec mtime = {0, 0};
+        if(stat(pathDirectories[i].name, &info) == 0){
+            mtime = info.st_mtim;
+        }
+        if(mtime.tv_sec != pathDirectories[i].mtime.tv_sec || mtime.tv_nsec != pathDirectories[i].mtime.tv_nsec){
+            pathDirectories[i].mtime = mtime;
+            if(firstChanged == -1) firstChanged = i;
+        }
+    }
+    if(firstChanged != -1){
+        dropPathEntries(firstChanged);
+    }
+}
+
+/*
+ * Return the absolute path of an executable, or NULL if it is not in PATH.
+ * Names containing a slash are used as they are.
+ */
+char *lookupPath(const char *name) {
+    if(strchr(name, '/') != NULL){
+        return (char *)name;
+    }
+    // A miss is remembered as long as a hit, a command installed meanwhile shows up within the interval
+    validatePath();
+    pathEntry *entry = findPathEntry(name);
+    if(entry->name == NULL){
+        char *found = NULL;
+        int dirIndex = pathDirectoryCount;
+        for(int i = 0; i < pathDirectoryCount && found == NULL; i++){
+            struct stat info;
+            size_t length = strlen(pathDirectories[i].name) + strlen(name) + 2;
+            char *candidate = malloc(length);
+            snprintf(candidate, length, "%s/%s", pathDirectories[i].name, name);
+            if(stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0){
+                found = candidate;
+                dirIndex = i;
+            }else{
+                free(candidate);
+            }
+        }
+        insertPathEntry(strdup(name), found, dirIndex, 0);
+        entry = findPathEntry(name);
+    }
+    entry->hits++;
+    return entry->path;
+}
+
+void hashCommands(char **pString) {
+    // Reset the table
+    if(pString[1] != NULL && strcmp(pString[1], "-r") == 0){
+        fillPath();
+        return;
+    }
+    // List cached commands
+    if(pathTableUsed == 0){
+        printf("hash table empty\n");
+        return;
+    }
+    printf("hits\tcommand\n");
+    for(size_t i = 0; i < pathTableSize; i++){
+        if(pathTable[i].name != NULL && pathTable[i].path != NULL){
+            printf("%4d\t%s\n", pathTable[i].hits, pathTable[i].path);
+        }
+    }
+}
+
+void parent_process(job *newJob) {
+    // If it is a foreground process, wait for the child.
+    if(newJob->background == 0){
+        waitForJob(newJob);
+        if(jobControl){
+            tcsetpgrp(STDIN_FILENO, shellGroup);
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &shellModes);
+        }
+        if(newJob->runningCount > 0){
+            // Stopped: it stays in the job table for fg and bg
+            newJob->background = 1;
+            printf("\n[%d]+  Stopped\t%s\n", newJob->id, newJob->command);
+            lastExitStatus = 128 + SIGTSTP;
+            return;
+        }
+        int status = newJob->lastProcess->status;
+        if(!batchMode && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT){
+            printf("\n");     /* the prompt goes below the ^C */
+        }
+        lastExitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    /*
+     * If it is a background process, it is already in the job table and
+     * runEvents() reaps it through its pidfd (or the signalfd without one),
+     * just tell the user about it.
+    */
+    else{
+        lastExitStatus = 0;
+        if(!batchMode){
+            printf("[%d] %ld\n", newJob->id, (long)newJob->lastProcess->id);
+        }
+    }
+}
+
+void *slabAllocate(slabAllocator *slab) {
+    if(slab->freeList == NULL){
+        char *chunk = malloc(slab->objectSize * SLAB_OBJECTS_PER_CHUNK);
+        if(chunk == NULL){
+            perror("malloc");
+            exit(1);
+        }
+        for(int i = SLAB_OBJECTS_PER_CHUNK - 1; i >= 0; i--){
+            slabFree(slab, chunk + i * slab->objectSize);
+        }
+    }
+    void **object = slab->freeList;
+    slab->freeList = *object;
+    return object;
+}
+
+void slabFree(slabAllocator *slab, void *object) {
+    *(void **)object = slab->freeList;
+    slab->freeList = object;
+}
+
+void initJobTable() {
+    processIndexSize = PROCESS_INDEX_INITIAL_SIZE;
+    processIndex = calloc(processIndexSize, sizeof(backgroundProcess *));
+}
+
+void initEventLoop() {
+    // A pidfd per background process: take all the descriptors we may, and keep a margin of them free
+    struct rlimit files;
+    if(getrlimit(RLIMIT_NOFILE, &files) == 0){
+        if(files.rlim_cur < files.rlim_max){
+            files.rlim_cur = files.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &files);
+            getrlimit(RLIMIT_NOFILE, &files);
+        }
+        pidfdLimit = files.rlim_cur == RLIM_INFINITY || files.rlim_cur > INT_MAX ? INT_MAX : (long)files.rlim_cur;
+        pidfdLimit -= PIDFD_RESERVE;
+    }
+
+    sigemptyset(&shellSignals);
+    sigaddset(&shellSignals, SIGCHLD);
+    sigaddset(&shellSignals, SIGTSTP);
+    sigaddset(&shellSignals, SIGINT);
+    sigprocmask(SIG_BLOCK, &shellSignals, NULL);
+
+    signalFd = signalfd(-1, &shellSignals, SFD_CLOEXEC | SFD_NONBLOCK);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    eventFd = epoll_create1(EPOLL_CLOEXEC);
+    if(signalFd == -1 || timerFd == -1 || eventFd == -1){
+        perror("event loop");
+        exit(1);
+    }
+    struct epoll_event event = {EPOLLIN, {.u64 = signalFd}};
+    epoll_ctl(eventFd, EPOLL_CTL_ADD, signalFd, &event);
+    event.data.u64 = timerFd;
+    epoll_ctl(eventFd, EPOLL_CTL_ADD, timerFd, &event);
+
+    // Children start with nothing blocked, and without the job control signals ignored
+    sigset_t none;
+    sigemptyset(&none);
+    sigset_t terminalSignals;
+    sigemptyset(&terminalSignals);
+    sigaddset(&terminalSignals, SIGTTOU);
+    sigaddset(&terminalSignals, SIGTTIN);
+    posix_spawnattr_init(&spawnAttributes);
+    posix_spawnattr_setsigmask(&spawnAttributes, &none);
+    posix_spawnattr_setsigdefault(&spawnAttributes, &terminalSignals);
+    posix_spawnattr_setflags(&spawnAttributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+}
+
+/*
+ * Interactive shell: wait until it is in the foreground, then move it to a
+ * process group of its own that owns the terminal. Each job gets its own
+ * group, so Control<z> and Control<c> reach only the foreground job.
+ */
+void initJobControl() {
+    while(tcgetpgrp(STDIN_FILENO) != (shellGroup = getpgrp())){
+        kill(-shellGroup, SIGTTIN);
+    }
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    shellGroup = getpid();
+    if(setpgid(0, shellGroup) == -1 && errno != EPERM){
+        perror("setpgid");
+        return;
+    }
+    shellGroup = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shellGroup);
+    tcgetattr(STDIN_FILENO, &shellModes);
+    jobControl = 1;
+}
+
+/*
+ * Put the command stream in the epoll set, disarmed until waitForInput().
+ * A regular file (EPERM) is always readable and is simply read.
+ */
+void watchInput(int fd) {
+    struct epoll_event event = {0, {.u64 = fd}};
+    if(fd == -1){
+        return;
+    }
+    if(epoll_ctl(eventFd, EPOLL_CTL_ADD, fd, &event) == 0){
+        watchedInputFd = fd;
+    }else if(errno != EPERM){
+        perror("epoll_ctl");
+    }
+}
+
+/* Handle events until fd has input. One-shot, so input typed ahead does not wake a job wait */
+void waitForInput(int fd) {
+    if(fd != watchedInputFd || eventFd == -1){
+        return;
+    }
+    struct epoll_event event = {EPOLLIN | EPOLLONESHOT, {.u64 = fd}};
+    epoll_ctl(eventFd, EPOLL_CTL_MOD, fd, &event);
+    while(!runEvents(-1));
+}
+
+/*
+ * Wait up to timeout milliseconds (-1 for ever) and handle what arrived.
+ * Returns 1 if the watched input became readable. Exited children are
+ * reaped here: through their pidfd, which is keyed in the epoll set as
+ * pid << 32 | pidfd, or on SIGCHLD for those without one.
+ */
+int runEvents(int timeout) {
+    if(eventFd == -1){
+        // A forked builtin: the epoll set is the shell's, so poll the signals and the timer
+        struct pollfd wake[2] = {{signalFd, POLLIN, 0}, {timerFd, POLLIN, 0}};
+        if(poll(wake, 2, timeout) > 0){
+            if(wake[0].revents & POLLIN){
+                handleSignals();
+            }
+            if(wake[1].revents & POLLIN){
+                expireTimers();
+            }
+        }
+        return 0;
+    }
+    struct epoll_event events[EVENT_BATCH];
+    int count = epoll_wait(eventFd, events, EVENT_BATCH, timeout);
+    int inputReady = 0;
+    for(int i = 0; i < count; i++){
+        int fd = (int)(events[i].data.u64 & 0xffffffffu);
+        pid_t pid = (pid_t)(events[i].data.u64 >> 32);
+        if(pid != 0){
+            reapExitedProcess(pid);
+        }else if(fd == signalFd){
+            handleSignals();
+        }else if(fd == timerFd){
+            expireTimers();
+        }else if(fd == watchedInputFd){
+            inputReady = 1;
+        }
+    }
+    if(atPrompt && unreportedJobs > 0 && !noticePending){
+        shellTimer notice = {phaseClock() + NOTICE_DELAY_NS, TIMER_NOTICE, NULL, 0, 0};
+        pushTimer(notice);
+        noticePending = 1;
+    }
+    return inputReady;
+}
+
+void handleSignals() {
+    struct signalfd_siginfo signals[EVENT_BATCH];
+    ssize_t bytes;
+    int childExited = 0;
+    while((bytes = read(signalFd, signals, sizeof(signals))) > 0){
+        for(size_t i = 0; i < bytes / sizeof(signals[0]); i++){
+            if(signals[i].ssi_signo == SIGCHLD){
+                childExited = 1;
+            }else if(signals[i].ssi_signo == SIGTSTP){
+                control_z();
+            }else if(signals[i].ssi_signo == SIGINT){
+                if(batchMode){
+                    exit(130);
+                }
+                // The foreground job got it from the terminal, at the prompt drop the typed line
+                if(atPrompt){
+                    tcflush(STDIN_FILENO, TCIFLUSH);
+                    printf("\nmyshell> ");
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+    if(childExited){
+        updateStoppedProcesses();
+        if(unwatchedProcesses > 0 || eventFd == -1){
+            reapChildren();
+        }
+    }
+}
+
+/* Stops and continues come only with SIGCHLD, pidfds report exits alone */
+void updateStoppedProcesses() {
+    while(1){
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        if(waitid(P_ALL, 0, &info, WSTOPPED | WCONTINUED | WNOHANG) == -1 || info.si_pid == 0){
+            return;
+        }
+        backgroundProcess *process = findBackgroundProcess(info.si_pid);
+        if(process == NULL){
+            continue;
+        }
+        if(info.si_code == CLD_STOPPED && !process->stopped){
+            process->stopped = 1;
+            process->owner->stoppedCount++;
+        }else if(info.si_code == CLD_CONTINUED && process->stopped){
+            process->stopped = 0;
+            process->owner->stoppedCount--;
+        }
+    }
+}
+
+/* Arm the timer for an absolute CLOCK_MONOTONIC time in nanoseconds, 0 disarms it */
+void armTimer(uint64_t deadline) {
+    struct itimerspec expiry = {{0, 0}, {deadline / 1000000000u, deadline % 1000000000u}};
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &expiry, NULL);
+}
+
+/* Run every timer that is due, then arm the timerfd for the next one */
+void expireTimers() {
+    uint64_t expirations;
+    read(timerFd, &expirations, sizeof(expirations));
+    uint64_t now = phaseClock();
+    while(timerCount > 0 && timerHeap[0].deadline <= now){
+        shellTimer due = timerHeap[0];
+        removeTimer(0);
+        fireTimer(&due, now);
+    }
+    armTimer(timerCount > 0 ? timerHeap[0].deadline : 0);
+}
+
+void fireTimer(shellTimer *timer, uint64_t now) {
+    if(timer->kind == TIMER_NOTICE){
+        noticePending = 0;
+        // Announce the jobs that finished while the prompt was up and draw it again
+        if(atPrompt && unreportedJobs > 0){
+            printf("\n");
+            notifyFinishedJobs();
+            printf("myshell> ");
+            fflush(stdout);
+        }
+        return;
+    }
+    job *entry = timer->entry;
+    entry->timedOut = 1;
+    for(backgroundProcess *process = entry->firstProcess; process != NULL; process = process->nextInJob){
+        signalProcess(process, timer->signal);
+    }
+    // A stopped job could not act on the signal
+    if(entry->stoppedCount > 0 && timer->signal != SIGKILL){
+        continueJob(entry, entry->background);
+    }
+    if(timer->grace > 0){
+        shellTimer kill = {now + timer->grace, TIMER_JOB, entry, SIGKILL, 0};
+        pushTimer(kill);
+    }
+}
+
+void pushTimer(shellTimer timer) {
+    if(timerCount == timerCapacity){
+        timerCapacity = timerCapacity == 0 ? TIMER_INITIAL_CAPACITY : timerCapacity * 2;
+        timerHeap = realloc(timerHeap, timerCapacity * sizeof(shellTimer));
+    }
+    int index = timerCount++;
+    while(index > 0 && timerHeap[(index - 1) / 2].deadline > timer.deadline){
+        timerHeap[index] = timerHeap[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+    timerHeap[index] = timer;
+    if(index == 0){
+        armTimer(timer.deadline);
+    }
+}
+
+/* Take out the timer at index; the caller re-arms the timerfd if the root changed */
+void removeTimer(int index) {
+    shellTimer last = timerHeap[--timerCount];
+    if(index == timerCount){
+        return;
+    }
+    // The last timer goes into the hole, up if it is earlier than the parent, else down
+    while(index > 0 && timerHeap[(index - 1) / 2].deadline > last.deadline){
+        timerHeap[index] = timerHeap[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+    while(1){
+        int child = 2 * index + 1;
+        if(child >= timerCount){
+            break;
+        }
+        if(child + 1 < timerCount && timerHeap[child + 1].deadline < timerHeap[child].deadline){
+            child++;
+        }
+        if(timerHeap[child].deadline >= last.deadline){
+            break;
+        }
+        timerHeap[index] = timerHeap[child];
+        index = child;
+    }
+    timerHeap[index] = last;
+}
+
+/* A finished job may be freed, so its deadlines go with it */
+void cancelJobTimers(job *entry) {
+    int removed = 0;
+    for(int i = timerCount - 1; i >= 0; i--){
+        if(timerHeap[i].kind == TIMER_JOB && timerHeap[i].entry == entry){
+            removeTimer(i);
+            removed = 1;
+        }
+    }
+    if(removed){
+        armTimer(timerCount > 0 ? timerHeap[0].deadline : 0);
+    }
+}
+
+job *createJob(int background, pipelineStage *stages, int stageCount) {
+    job *newJob = slabAllocate(&jobSlab);
+    memset(newJob, 0, sizeof(job));
+    if(runningJobs.count == 0){
+        nextJobId = 1;
+    }
+    newJob->id = nextJobId++;
+    newJob->background = background;
+    clock_gettime(CLOCK_MONOTONIC, &newJob->started);
+
+    // Keep a printable copy of the command for ps_all
+    size_t used = 0;
+    for(int i = 0; i < stageCount; i++){
+        for(char **arg = stages[i].args; *arg != NULL; arg++){
+            int written = snprintf(newJob->command + used, JOB_COMMAND_LENGTH - used, "%s%s",
+                                   used == 0 ? "" : " ", *arg);
+            if(written < 0 || used + written >= JOB_COMMAND_LENGTH){
+                used = JOB_COMMAND_LENGTH - 1;
+                break;
+            }
+            used += written;
+        }
+        if(i < stageCount - 1 && used + 2 < JOB_COMMAND_LENGTH){
+            used += snprintf(newJob->command + used, JOB_COMMAND_LENGTH - used, " |");
+        }
+    }
+    appendJob(&runningJobs, newJob);
+    return newJob;
+}
+
+/*
+ * Add a started child to a job. The child is not reaped yet, so its pid
+ * cannot have been reused and pidfd_open() refers to the right process.
+ * Without a pidfd (past pidfdLimit or out of descriptors) or a place in the
+ * epoll set the process is reaped on SIGCHLD instead.
+ */
+backgroundProcess *createNewBackgroundProcess(job *owner, pid_t child) {
+    backgroundProcess *newBackgroundProcess = slabAllocate(&processSlab);
+    newBackgroundProcess->id = child;
+    newBackgroundProcess->pidfd = -1;
+    if(pidfdCount < pidfdLimit){
+        newBackgroundProcess->pidfd = (int)syscall(SYS_pidfd_open, child, 0);
+        pidfdCount += newBackgroundProcess->pidfd != -1;
+    }
+    newBackgroundProcess->watched = 0;
+    if(newBackgroundProcess->pidfd != -1 && eventFd != -1){
+        struct epoll_event event = {EPOLLIN, {.u64 = (uint64_t)child << 32 | (uint32_t)newBackgroundProcess->pidfd}};
+        newBackgroundProcess->watched = epoll_ctl(eventFd, EPOLL_CTL_ADD, newBackgroundProcess->pidfd, &event) == 0;
+    }
+    if(!newBackgroundProcess->watched){
+        unwatchedProcesses++;
+    }
+    newBackgroundProcess->status = 0;
+    newBackgroundProcess->running = 1;
+    newBackgroundProcess->stopped = 0;
+    newBackgroundProcess->owner = owner;
+    newBackgroundProcess->nextInJob = NULL;
+    if(owner->lastProcess == NULL){
+        owner->firstProcess = newBackgroundProcess;
+    }else{
+        owner->lastProcess->nextInJob = newBackgroundProcess;
+    }
+    owner->lastProcess = newBackgroundProcess;
+    owner->processCount++;
+    owner->runningCount++;
+    addNewBackgroundProcess(newBackgroundProcess);
+    return newBackgroundProcess;
+}
+
+/* A pidfd became readable: collect that process, and only that one */
+void reapExitedProcess(pid_t pid) {
+    backgroundProcess *process = findBackgroundProcess(pid);
+    if(process == NULL || process->pidfd == -1){
+        return;     /* reaped by wait4() earlier in the same round */
+    }
+    siginfo_t info;
+    struct rusage usage;
+    memset(&info, 0, sizeof(info));
+    if(syscall(SYS_waitid, P_PIDFD, process->pidfd, &info, WEXITED | WNOHANG, &usage) == -1 || info.si_pid == 0){
+        return;
+    }
+    // Rebuild the wait status the W* macros expect
+    int status;
+    if(info.si_code == CLD_EXITED){
+        status = (info.si_status & 0xff) << 8;
+    }else{
+        status = (info.si_status & 0x7f) | (info.si_code == CLD_DUMPED ? 0x80 : 0);
+    }
+    reapProcess(pid, status, &usage);
+}
+
+/* Signal a process that has not been reaped, through its pidfd when it has one */
+int signalProcess(backgroundProcess *process, int signal) {
+    if(!process->running){
+        return -1;
+    }
+    if(process->pidfd != -1){
+        return (int)syscall(SYS_pidfd_send_signal, process->pidfd, signal, NULL, 0);
+    }
+    return kill(process->id, signal);
+}
+
+static size_t processSlot(pid_t pid) {
+    return ((size_t)pid * 2654435761u) & (processIndexSize - 1);
+}
+
+void addNewBackgroundProcess(backgroundProcess *process) {
+    // Grow the index so buckets stay at about one process each
+    if(processIndexCount + 1 > processIndexSize){
+        backgroundProcess **old = processIndex;
+        size_t oldSize = processIndexSize;
+        processIndexSize *= 2;
+        processIndex = calloc(processIndexSize, sizeof(backgroundProcess *));
+        for(size_t i = 0; i < oldSize; i++){
+            backgroundProcess *iter = old[i];
+            while(iter != NULL){
+                backgroundProcess *next = iter->nextBackgroundProcess;
+                size_t slot = processSlot(iter->id);
+                iter->nextBackgroundProcess = processIndex[slot];
+                processIndex[slot] = iter;
+                iter = next;
+            }
+        }
+        free(old);
+    }
+    size_t slot = processSlot(process->id);
+    process->nextBackgroundProcess = processIndex[slot];
+    processIndex[slot] = process;
+    processIndexCount++;
+}
+
+backgroundProcess *findBackgroundProcess(pid_t pid) {
+    backgroundProcess *iter = processIndex[processSlot(pid)];
+    while(iter != NULL && iter->id != pid){
+        iter = iter->nextBackgroundProcess;
+    }
+    return iter;
+}
+
+void removeBackgroundProcess(backgroundProcess *process) {
+    backgroundProcess **link = &processIndex[processSlot(process->id)];
+    while(*link != process){
+        link = &(*link)->nextBackgroundProcess;
+    }
+    *link = process->nextBackgroundProcess;
+    processIndexCount--;
+}
+
+void appendJob(jobList *list, job *entry) {
+    entry->nextJob = NULL;
+    entry->previousJob = list->tail;
+    if(list->tail == NULL){
+        list->head = entry;
+    }else{
+        list->tail->nextJob = entry;
+    }
+    list->tail = entry;
+    list->count++;
+}
+
+void removeJob(jobList *list, job *entry) {
+    if(entry->previousJob == NULL){
+        list->head = entry->nextJob;
+    }else{
+        entry->previousJob->nextJob = entry->nextJob;
+    }
+    if(entry->nextJob == NULL){
+        list->tail = entry->previousJob;
+    }else{
+        entry->nextJob->previousJob = entry->previousJob;
+    }
+    list->count--;
+}
+
+/* In a forked child: drop the pidfds inherited from the shell, signals go by pid then */
+void closeJobDescriptors() {
+    for(job *entry = runningJobs.head; entry != NULL; entry = entry->nextJob){
+        for(backgroundProcess *process = entry->firstProcess; process != NULL; process = process->nextInJob){
+            if(process->pidfd != -1){
+                close(process->pidfd);
+                process->pidfd = -1;
+                pidfdCount--;
+            }
+        }
+    }
+}
+
+/*
+ * Record the exit and resource usage of a reaped process. When the last
+ * process of a job is gone the job moves to the finished list, which keeps
+ * only the most recent FINISHED_JOBS_KEPT jobs.
+ */
+void moveBackgroundProcessToFinished(backgroundProcess *process, int status, struct rusage *usage) {
+    job *owner = process->owner;
+    process->running = 0;
+    process->status = status;
+    process->usage = *usage;
+    clock_gettime(CLOCK_MONOTONIC, &process->finished);
+    if(process->pidfd != -1){
+        // A forked builtin may still hold a copy of the pidfd, so closing ours would leave it registered
+        if(process->watched){
+            epoll_ctl(eventFd, EPOLL_CTL_DEL, process->pidfd, NULL);
+        }
+        close(process->pidfd);
+        process->pidfd = -1;
+        pidfdCount--;
+    }
+    if(!process->watched){
+        unwatchedProcesses--;
+    }
+    if(process->stopped){
+        process->stopped = 0;
+        owner->stoppedCount--;
+    }
+    removeBackgroundProcess(process);
+    owner->runningCount--;
+    if(owner->runningCount > 0){
+        return;
+    }
+    cancelJobTimers(owner);
+    if(owner->cgroup != NULL){
+        rmdir(owner->cgroup);   /* fails while something the job started still lives there */
+        free(owner->cgroup);
+        owner->cgroup = NULL;
+    }
+    removeJob(&runningJobs, owner);
+    appendJob(&finishedJobs, owner);
+    if(owner->background){
+        unreportedJobs++;
+    }
+    job *oldest = finishedJobs.head;
+    while(oldest != NULL && oldest->pinned){
+        oldest = oldest->nextJob;
+    }
+    if(finishedJobs.count > FINISHED_JOBS_KEPT && oldest != NULL){
+        removeJob(&finishedJobs, oldest);
+        if(oldest->background && unreportedJobs > finishedJobs.count){
+            unreportedJobs--;
+        }
+        freeJob(oldest);
+    }
+}
+
+void freeJob(job *entry) {
+    backgroundProcess *iter = entry->firstProcess;
+    while(iter != NULL){
+        backgroundProcess *next = iter->nextInJob;
+        slabFree(&processSlab, iter);
+        iter = next;
+    }
+    free(entry->cgroup);
+    slabFree(&jobSlab, entry);
+}
+
+/* Reap every child that has exited, without blocking */
+void reapChildren() {
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0){
+        reapProcess(pid, status, &usage);
+    }
+}
+
+/* Hand a child collected by wait4() to the job table, if it is one of ours */
+void reapProcess(pid_t pid, int status, struct rusage *usage) {
+    backgroundProcess *process = findBackgroundProcess(pid);
+    if(process != NULL){
+        moveBackgroundProcessToFinished(process, status, usage);
+    }
+}
+
+/*
+ * Block until every process of the job has exited or stopped, reaping
+ * others on the way. An exited child keeps its pidfd readable and SIGCHLD
+ * pending until it is collected, so an exit before the wait still wakes
+ * the loop.
+ */
+void waitForJob(job *entry) {
+    while(entry->runningCount > entry->stoppedCount){
+        runEvents(-1);
+    }
+}
+
+void notifyFinishedJobs() {
+    reapChildren();
+    if(unreportedJobs == 0){
+        return;
+    }
+    // The jobs to announce are the newest background jobs of the finished list
+    job *iter = finishedJobs.tail;
+    job *first = NULL;
+    int remaining = unreportedJobs;
+    while(iter != NULL && remaining > 0){
+        if(iter->background){
+            first = iter;
+            remaining--;
+        }
+        iter = iter->previousJob;
+    }
+    for(iter = first; iter != NULL && !batchMode; iter = iter->nextJob){
+        if(!iter->background){
+            continue;
+        }
+        // As other shells do: how the last process of the pipeline ended
+        int status = iter->lastProcess->status;
+        if(WIFSIGNALED(status)){
+            printf("[%d] %s%s\t%s\n", iter->id, strsignal(WTERMSIG(status)),
+                   WCOREDUMP(status) ? " (core dumped)" : "", iter->command);
+        }else if(WEXITSTATUS(status) != 0){
+            printf("[%d] Exit %d\t%s\n", iter->id, WEXITSTATUS(status), iter->command);
+        }else{
+            printf("[%d] Done\t%s\n", iter->id, iter->command);
+        }
+    }
+    unreportedJobs = 0;
+}
+
+void child_process(pipelineStage *stage, char *executable) {
+    // Redirections, after the pipe ends are in place
+    if(runRedirections(stage->plan, stage->planLength) != 0){
+        exit(1);
+    }
+    // Builtins run to completion in the child
+    const shellBuiltin *command = findBuiltin(stage->args[0]);
+    if (command != NULL){
+        // The epoll set stays with the shell, a builtin waiting for children polls the signalfd
+        close(eventFd);
+        eventFd = -1;
+        watchedInputFd = -1;
+        // The timerfd is shared with the shell too, and the shell's deadlines are not ours
+        close(timerFd);
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        timerCount = 0;
+        // So are the pidfds of the shell's jobs, their processes are not ours to reap
+        closeJobDescriptors();
+        // Only the shell hands out the terminal, a builtin's children stay in this job's group
+        jobControl = 0;
+        foregroundJob = NULL;
+        foreground = 0;
+        sigset_t interrupt;
+        sigemptyset(&interrupt);
+        sigaddset(&interrupt, SIGINT);
+        sigprocmask(SIG_UNBLOCK, &interrupt, NULL);
+        exit(runBuiltinToPipe(command, stage->args));
+    }
+    // Execute the command resolved by the parent
+    executeArgument(executable, stage->args);
+
+}
+
+/*
+ * Carry out a redirection plan in this process. An open that lands on its
+ * descriptor directly needs no dup2() or close(). Returns 0, or -1 after
+ * reporting the failing step.
+ */
+int runRedirections(fdOperation *plan, int length) {
+    for(int i = 0; i < length; i++){
+        fdOperation *step = &plan[i];
+        if(step->operation == FD_OPEN){
+            int fd = open(step->file, step->flags, CREATE_MODE);
+            if(fd == -1){
+                fprintf(stderr, "%s: %s\n", step->file, strerror(errno));
+                return -1;
+            }
+            if(fd != step->fd){
+                int result = dup2(fd, step->fd);
+                close(fd);
+                if(result == -1){
+                    fprintf(stderr, "%d: %s\n", step->fd, strerror(errno));
+                    return -1;
+                }
+            }
+        }else if(step->operation == FD_DUP){
+            if(dup2(step->source, step->fd) == -1){
+                fprintf(stderr, "%d: %s\n", step->source, strerror(errno));
+                return -1;
+            }
+        }else{
+            close(step->fd);
+        }
+    }
+    return 0;
+}
+
+const shellBuiltin *findBuiltin(const char *name) {
+    size_t length = strlen(name);
+    if(length == 0){
+        return NULL;
+    }
+    const shellBuiltin *command = &builtinTable[BUILTIN_SLOT(name[0], length)];
+    if(command->name == NULL || strcmp(command->name, name) != 0){
+        return NULL;
+    }
+    return command;
+}
+
+/*
+ * Run a builtin inside the shell. The redirection is applied to the shell's
+ * own descriptors and the saved originals are put back afterwards.
+ */
+int runBuiltin(const shellBuiltin *command, pipelineStage *stage) {
+    int targets[stage->planLength + 1];
+    int saved[stage->planLength + 1];
+    int targetCount = 0;
+    if(stage->planLength > 0){
+        fflush(NULL);
+    }
+    // Keep a copy of every descriptor the plan replaces, -1 if it was not open
+    for(int i = 0; i < stage->planLength; i++){
+        int fd = stage->plan[i].fd;
+        int seen = 0;
+        for(int j = 0; j < targetCount; j++){
+            seen |= targets[j] == fd;
+        }
+        if(!seen){
+            targets[targetCount] = fd;
+            saved[targetCount++] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        }
+    }
+
+    int status = 1;
+    if(runRedirections(stage->plan, stage->planLength) == 0){
+        status = command->run(stage->args);
+    }
+
+    if(targetCount > 0){
+        fflush(NULL);
+    }
+    for(int i = 0; i < targetCount; i++){
+        if(saved[i] == -1){
+            close(targets[i]);
+        }else{
+            dup2(saved[i], targets[i]);
+            close(saved[i]);
+        }
+    }
+    return status;
+}
+
+/*
+ * Run a builtin in a pipeline child. When its output goes to a pipe the
+ * output is collected in memory and handed to the pipe with vmsplice(), so
+ * the pages are passed by reference instead of being copied by write().
+ */
+int runBuiltinToPipe(const shellBuiltin *command, char **pString) {
+    struct stat info;
+    if(fstat(STDOUT_FILENO, &info) == -1 || !S_ISFIFO(info.st_mode)){
+        int status = command->run(pString);
+        fflush(NULL);
+        return status;
+    }
+
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *memory = open_memstream(&buffer, &length);
+    if(memory == NULL){
+        int status = command->run(pString);
+        fflush(NULL);
+        return status;
+    }
+    FILE *terminal = stdout;
+    stdout = memory;
+    int status = command->run(pString);
+    stdout = terminal;
+    fclose(memory);
+    fflush(stderr);
+
+    if(writeToPipe(STDOUT_FILENO, buffer, length) == -1 && errno != EPIPE){
+        perror(pString[0]);
+    }
+    return status;
+}
+
+int writeToPipe(int fd, const char *buffer, size_t length) {
+    while(length > 0){
+        struct iovec chunk = {(void *)buffer, length};
+        ssize_t written = vmsplice(fd, &chunk, 1, 0);
+        if(written == -1 && (errno == EINVAL || errno == ENOSYS)){
+            written = write(fd, buffer, length);
+        }
+        if(written == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/*
+ * Start every stage of the pipeline at once, each stage reading the pipe
+ * of the previous one, and return them as a single job for parent_process()
+ * to wait on. A lone foreground builtin runs inside the shell instead and
+ * NULL is returned, as it is when nothing could be started.
+ */
+job *executePipeline(pipelineStage *stages, int stageCount, int background) {
+    if(stageCount == 1 && background == 0){
+        const shellBuiltin *command = findBuiltin(stages[0].args[0]);
+        if(command != NULL){
+            uint64_t start = phaseClock();
+            lastExitStatus = runBuiltin(command, &stages[0]);
+            recordPhase(PHASE_DISPATCH, start);
+            return NULL;
+        }
+    }
+
+    // Anything the shell printed must come out before the children's output
+    if(__fpending(stdout) > 0){
+        fflush(stdout);
+    }
+
+    pid_t children[stageCount];
+    int started = 0;
+    int inputFd = -1;
+    // With job control the first child starts the job's process group, a foreground one gets the terminal.
+    // A builtin such as time with stdin redirected has no terminal to give, its job stays in our group
+    int terminal = jobControl && !background && tcgetpgrp(STDIN_FILENO) == shellGroup ? STDIN_FILENO : -1;
+    pid_t group = jobControl && (background || terminal != -1) ? 0 : -1;
+    for(int i = 0; i < stageCount; i++){
+        int pipeFds[2] = {-1, -1};
+        if(i < stageCount - 1 && pipe2(pipeFds, O_CLOEXEC) == -1){
+            perror("pipe");
+            break;
+        }
+
+        pid_t child = -1;
+        const shellBuiltin *command = findBuiltin(stages[i].args[0]);
+        if(command != NULL){
+            // A builtin stage needs a process of its own to run concurrently
+            uint64_t start = phaseClock();
+            child = fork();
+            if(child > 0){
+                recordPhase(PHASE_FORK, start);
+                if(group != -1){
+                    setpgid(child, group == 0 ? child : group);
+                }
+            }
+            if (child == -1) {
+                perror("Error occured during forking child.\n");
+            }
+            if (child == 0){
+                joinProcessGroup(group, terminal);
+                if(inputFd != -1){
+                    dup2(inputFd, STDIN_FILENO);
+                    close(inputFd);
+                }else if(nullInputFd != -1){
+                    dup2(nullInputFd, STDIN_FILENO);
+                }
+                if(pipeFds[1] != -1){
+                    dup2(pipeFds[1], STDOUT_FILENO);
+                    close(pipeFds[0]);
+                    close(pipeFds[1]);
+                }
+                child_process(&stages[i], NULL);
+            }
+        }else{
+            uint64_t start = phaseClock();
+            char *executable = lookupPath(stages[i].args[0]);
+            recordPhase(PHASE_RESOLVE, start);
+            if(executable == NULL){
+                fprintf(stderr, "%s: command not found\n", stages[i].args[0]);
+            }else{
+                start = phaseClock();
+                child = spawnProcess(executable, &stages[i], inputFd, pipeFds[1], group, terminal);
+                recordPhase(PHASE_SPAWN, start);
+            }
+        }
+
+        // The parent keeps only the read end for the next stage
+        if(inputFd != -1){
+            close(inputFd);
+        }
+        if(pipeFds[1] != -1){
+            close(pipeFds[1]);
+        }
+        inputFd = pipeFds[0];
+
+        if(child != -1){
+            children[started++] = child;
+            if(group == 0){
+                group = child;
+            }
+        }
+    }
+    if(inputFd != -1){
+        close(inputFd);
+    }
+
+    if(started == 0){
+        lastExitStatus = 127;
+        return NULL;
+    }
+
+    // Every stage goes into the job table before anything is waited for
+    job *newJob = createJob(background, stages, stageCount);
+    newJob->processGroup = group > 0 ? group : 0;
+    for(int i = 0; i < started; i++){
+        createNewBackgroundProcess(newJob, children[i]);
+    }
+
+    // Set ID of Foregorund Process
+    if (background == 0){
+        foregroundJob = newJob;
+        foreground = 1;
+    }
+
+    return newJob;
+}
+
+int builtinPsAll(char **args) {
+    printProcesses();
+    return 0;
+}
+
+int builtinBookmark(char **args) {
+    if(args[1] == NULL){
+        fprintf(stderr, "bookmark: usage: bookmark \"command\" | -l | -d index | -i index | -h history\n");
+        return 2;
+    }
+    if(strcmp(args[1], "-i") == 0){
+        return runBookmark(args[2]);
+    }
+    bookmarkCommands(args);
+    return 0;
+}
+
+int builtinExit(char **args) {
+    checkAndExit();
+    return 1;
+}
+
+int builtinCd(char **args) {
+    const char *directory = args[1];
+    if(directory == NULL){
+        directory = getenv("HOME");
+    }else if(strcmp(directory, "-") == 0){
+        directory = getenv("OLDPWD");
+    }
+    if(directory == NULL){
+        fprintf(stderr, "cd: no directory\n");
+        return 1;
+    }
+    char previous[4096];
+    if(getcwd(previous, sizeof(previous)) == NULL){
+        previous[0] = '\0';
+    }
+    if(chdir(directory) == -1){
+        fprintf(stderr, "cd: %s: %s\n", directory, strerror(errno));
+        return 1;
+    }
+    char current[4096];
+    if(previous[0] != '\0'){
+        setenv("OLDPWD", previous, 1);
+    }
+    if(getcwd(current, sizeof(current)) != NULL){
+        setenv("PWD", current, 1);
+    }
+    return 0;
+}
+
+int builtinPwd(char **args) {
+    char current[4096];
+    if(getcwd(current, sizeof(current)) == NULL){
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", current);
+    return 0;
+}
+
+int builtinHash(char **args) {
+    hashCommands(args);
+    return 0;
+}
+
+int builtinHistory(char **args) {
+    if(args[1] == NULL){
+        listHistory(HISTORY_RING_SIZE);
+    }else if(strcmp(args[1], "-s") == 0 && args[2] != NULL){
+        searchHistory(args[2]);
+    }else if(args[1][0] >= '0' && args[1][0] <= '9'){
+        listHistory(atol(args[1]));
+    }else{
+        fprintf(stderr, "history: usage: history [count] | -s pattern\n");
+        return 2;
+    }
+    return 0;
+}
+
+/*
+ * parallel [-j N] command [args] ::: items, or with the items as lines on
+ * stdin. Runs command once per item with the item as its last argument,
+ * keeping at most N children (the online CPUs by default) in flight.
+ */
+int builtinParallel(char **args) {
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+    if(args[1] != NULL && strncmp(args[1], "-j", 2) == 0){
+        if(args[1][2] != '\0'){
+            limit = atol(&args[1][2]);
+            first = 2;
+        }else if(args[2] != NULL){
+            limit = atol(args[2]);
+            first = 3;
+        }
+    }
+    int separator = first;
+    while(args[separator] != NULL && strcmp(args[separator], ":::") != 0){
+        separator++;
+    }
+    parallelItems items = {&args[first], separator - first, NULL, 0};
+    if(args[separator] != NULL){
+        items.items = &args[separator + 1];
+    }
+    if(items.prefixLength == 0 || limit < 1){
+        fprintf(stderr, "parallel: usage: parallel [-j jobs] command [args] [::: items]\n");
+        return 2;
+    }
+    char *executable = lookupPath(args[first]);
+    if(executable == NULL){
+        fprintf(stderr, "%s: command not found\n", args[first]);
+        return 127;
+    }
+    return runBatches("parallel", executable, limit, items.items == NULL, nextParallelItem, &items);
+}
+
+/*
+ * xargs [-0] [-n max] [-P jobs] [command [args]] reads items from stdin,
+ * separated by newlines or with -0 by null characters, and runs command
+ * (echo by default) with as many of them as one exec can take: ARG_MAX less
+ * the environment, the fixed arguments and some headroom. With -P the
+ * batches run concurrently.
+ */
+int builtinXargs(char **args) {
+    xargsItems items = {NULL, 0, '\n', 0, 0, NULL, 0};
+    long limit = 1;
+    int first = 1;
+    for(; args[first] != NULL && args[first][0] == '-'; first++){
+        if(strcmp(args[first], "-0") == 0){
+            items.delimiter = '\0';
+        }else if(strcmp(args[first], "-n") == 0 && args[first + 1] != NULL){
+            items.maxItems = atol(args[++first]);
+        }else if(strcmp(args[first], "-P") == 0 && args[first + 1] != NULL){
+            limit = atol(args[++first]);
+        }else{
+            break;
+        }
+    }
+    static char *defaultCommand[] = {"echo", NULL};
+    items.prefix = args[first] != NULL ? &args[first] : defaultCommand;
+    while(items.prefix[items.prefixLength] != NULL){
+        items.prefixLength++;
+    }
+    if(limit < 1){
+        limit = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    // What the kernel counts against ARG_MAX: every string and its pointer
+    long argMax = sysconf(_SC_ARG_MAX);
+    size_t used = XARGS_HEADROOM + sizeof(char *);
+    for(char **variable = environ; *variable != NULL; variable++){
+        used += strlen(*variable) + 1 + sizeof(char *);
+    }
+    for(int i = 0; i < items.prefixLength; i++){
+        used += strlen(items.prefix[i]) + 1 + sizeof(char *);
+    }
+    if(argMax <= 0 || (size_t)argMax <= used){
+        fprintf(stderr, "xargs: no room for arguments\n");
+        return 1;
+    }
+    items.budget = argMax - used;
+
+    char *executable = lookupPath(items.prefix[0]);
+    if(executable == NULL){
+        fprintf(stderr, "%s: command not found\n", items.prefix[0]);
+        return 127;
+    }
+    int failures = runBatches("xargs", executable, limit, 1, nextXargsBatch, &items);
+    free(items.pending);
+    if(failures > PARALLEL_MAX_FAILURES){
+        return failures;    /* interrupted or stopped */
+    }
+    return failures == 0 ? 0 : 123;     /* the status xargs uses when a command failed */
+}
+
+/*
+ * time [command [args]] runs command in the foreground and reports its
+ * wall time and the resource usage wait4() collected, summed over its
+ * processes, on stderr. A builtin is measured with getrusage() around it,
+ * its max RSS is that of the shell.
+ * Without a command the last finished job is reported.
+ */
+int builtinTime(char **args) {
+    if(args[1] == NULL){
+        reapChildren();
+        if(finishedJobs.tail == NULL){
+            fprintf(stderr, "time: no finished job\n");
+            return 1;
+        }
+        struct rusage total;
+        double wall = jobUsage(finishedJobs.tail, &total);
+        fprintf(stderr, "[%d] %s\n", finishedJobs.tail->id, finishedJobs.tail->command);
+        printUsage(stderr, wall, &total);
+        return 0;
+    }
+
+    const shellBuiltin *command = findBuiltin(args[1]);
+    if(command != NULL){
+        struct rusage self[2], children[2];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        getrusage(RUSAGE_SELF, &self[0]);
+        getrusage(RUSAGE_CHILDREN, &children[0]);
+        int status = command->run(&args[1]);
+        getrusage(RUSAGE_SELF, &self[1]);
+        getrusage(RUSAGE_CHILDREN, &children[1]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        struct rusage delta = self[1];
+        timersub(&self[1].ru_utime, &self[0].ru_utime, &delta.ru_utime);
+        timersub(&self[1].ru_stime, &self[0].ru_stime, &delta.ru_stime);
+        timeradd(&delta.ru_utime, &children[1].ru_utime, &delta.ru_utime);
+        timersub(&delta.ru_utime, &children[0].ru_utime, &delta.ru_utime);
+        timeradd(&delta.ru_stime, &children[1].ru_stime, &delta.ru_stime);
+        timersub(&delta.ru_stime, &children[0].ru_stime, &delta.ru_stime);
+        delta.ru_nvcsw = self[1].ru_nvcsw - self[0].ru_nvcsw + children[1].ru_nvcsw - children[0].ru_nvcsw;
+        delta.ru_nivcsw = self[1].ru_nivcsw - self[0].ru_nivcsw + children[1].ru_nivcsw - children[0].ru_nivcsw;
+        fflush(stdout);
+        printUsage(stderr, elapsedSeconds(&start, &end), &delta);
+        return status;
+    }
+
+    pipelineStage stage = {&args[1], NULL, 0};
+    job *entry = executePipeline(&stage, 1, 0);
+    if(entry == NULL){
+        return lastExitStatus;
+    }
+    parent_process(entry);
+    foreground = 0;
+    if(entry->runningCount == 0){
+        struct rusage total;
+        double wall = jobUsage(entry, &total);
+        printUsage(stderr, wall, &total);
+    }
+    return lastExitStatus;
+}
+
+double elapsedSeconds(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void printUsage(FILE *out, double wall, struct rusage *usage) {
+    fprintf(out, "real %.3fs  user %ld.%03lds  sys %ld.%03lds  maxrss %ld KB  ctxsw %ld+%ld\n", wall,
+            (long)usage->ru_utime.tv_sec, (long)usage->ru_utime.tv_usec / 1000,
+            (long)usage->ru_stime.tv_sec, (long)usage->ru_stime.tv_usec / 1000,
+            usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+/*
+ * Sum the usage of the processes of a finished job into total: CPU times
+ * and context switches add up, max RSS is the largest. Returns the wall
+ * time from the start of the job to its last exit.
+ */
+double jobUsage(job *entry, struct rusage *total) {
+    memset(total, 0, sizeof(*total));
+    double wall = 0;
+    for(backgroundProcess *process = entry->firstProcess; process != NULL; process = process->nextInJob){
+        timeradd(&total->ru_utime, &process->usage.ru_utime, &total->ru_utime);
+        timeradd(&total->ru_stime, &process->usage.ru_stime, &total->ru_stime);
+        total->ru_nvcsw += process->usage.ru_nvcsw;
+        total->ru_nivcsw += process->usage.ru_nivcsw;
+        if(process->usage.ru_maxrss > total->ru_maxrss){
+            total->ru_maxrss = process->usage.ru_maxrss;
+        }
+        double seconds = elapsedSeconds(&entry->started, &process->finished);
+        if(seconds > wall){
+            wall = seconds;
+        }
+    }
+    return wall;
+}
+
+/*
+ * shellstat [-b] [-r]: latency of each phase of running commands since the
+ * shell started or the last reset, from the phase histograms. -b also
+ * prints the non-empty buckets, -r clears the histograms after printing.
+ * spawn includes the exec of the child, posix_spawn() returns after it.
+ */
+int builtinShellstat(char **args) {
+    int buckets = 0;
+    int reset = 0;
+    for(int i = 1; args[i] != NULL; i++){
+        if(strcmp(args[i], "-b") == 0){
+            buckets = 1;
+        }else if(strcmp(args[i], "-r") == 0){
+            reset = 1;
+        }else{
+            fprintf(stderr, "shellstat: usage: shellstat [-b] [-r]\n");
+            return 2;
+        }
+    }
+    printf("%-9s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+    for(int phase = 0; phase < PHASE_COUNT; phase++){
+        phaseHistogram *histogram = &phaseStats[phase];
+        if(histogram->count == 0){
+            printf("%-9s %10d\n", phaseNames[phase], 0);
+            continue;
+        }
+        printf("%-9s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", phaseNames[phase], (unsigned long)histogram->count,
+               histogram->total / 1e3 / histogram->count, phasePercentile(histogram, 0.5) / 1e3,
+               phasePercentile(histogram, 0.9) / 1e3, phasePercentile(histogram, 0.99) / 1e3, histogram->max / 1e3);
+        if(buckets){
+            for(int bucket = 0; bucket < PHASE_BUCKETS; bucket++){
+                if(histogram->buckets[bucket] != 0){
+                    printf("%20s >= %12.3f us %10lu\n", "", phaseBucketStart(bucket) / 1e3,
+                           (unsigned long)histogram->buckets[bucket]);
+                }
+            }
+        }
+    }
+    if(reset){
+        memset(phaseStats, 0, sizeof(phaseStats));
+    }
+    return 0;
+}
 
-    // Control<z>
-    signal(SIGTSTP, control_z);
+uint64_t phaseClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
 
-    // Input Output Flags
-    int inputOutputFlag;
+static inline int phaseBucket(uint64_t value) {
+    if(value < (1u << PHASE_SUB_BITS)){
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (int)(value >> (exponent - PHASE_SUB_BITS)) & ((1 << PHASE_SUB_BITS) - 1);
+    return ((exponent - PHASE_SUB_BITS + 1) << PHASE_SUB_BITS) + sub;
+}
 
-    // Init head of background process linked list
-    initLinkedList();
+/* Smallest value that falls in a bucket */
+uint64_t phaseBucketStart(int bucket) {
+    if(bucket < (1 << PHASE_SUB_BITS)){
+        return bucket;
+    }
+    int exponent = (bucket >> PHASE_SUB_BITS) + PHASE_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << PHASE_SUB_BITS) - 1);
+    return ((1u << PHASE_SUB_BITS) + sub) << (exponent - PHASE_SUB_BITS);
+}
 
-    // Read Path Variables and Fill Path Array
-    fillPath();
+void recordPhase(int phase, uint64_t start) {
+    uint64_t elapsed = phaseClock() - start;
+    phaseHistogram *histogram = &phaseStats[phase];
+    histogram->buckets[phaseBucket(elapsed)]++;
+    histogram->count++;
+    histogram->total += elapsed;
+    if(elapsed > histogram->max){
+        histogram->max = elapsed;
+    }
+}
 
+/* Start of the bucket holding the given fraction of the recorded values */
+uint64_t phasePercentile(phaseHistogram *histogram, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * histogram->count);
+    uint64_t seen = 0;
+    for(int bucket = 0; bucket < PHASE_BUCKETS; bucket++){
+        seen += histogram->buckets[bucket];
+        if(seen > rank){
+            return phaseBucketStart(bucket);
+        }
+    }
+    return histogram->max;
+}
 
-    while (1){
-        background = 0;
+int builtinJobs(char **args) {
+    for(job *entry = runningJobs.head; entry != NULL; entry = entry->nextJob){
+        printf("[%d]%c  %-8s\t%s\n", entry->id, entry == runningJobs.tail ? '+' : ' ',
+               entry->runningCount == entry->stoppedCount ? "Stopped" : "Running", entry->command);
+    }
+    return 0;
+}
 
-        // Print our shell to the screen and wait for the user input
-        printf("myshell> ");
-        fflush(NULL);
+/* fg [%n]: continue a job in the foreground and wait for it */
+int builtinFg(char **args) {
+    job *entry = findJobArgument("fg", args[1]);
+    if(entry == NULL){
+        return 1;
+    }
+    printf("%s\n", entry->command);
+    fflush(stdout);
+    continueJob(entry, 0);
+    foregroundJob = entry;
+    foreground = 1;
+    parent_process(entry);
+    foreground = 0;
+    return lastExitStatus;
+}
 
-        /*setup() calls exit() when Control-D is entered */
-        setup(inputBuffer, args, &background);
-
-        if(strcmp(args[0], "bookmark") == 0){
-            // Run a command
-            if(strcmp(args[1], "-i") == 0){
-                // find command
-                char *command = findCommand(atoi(args[2]));
-                printf("%s\n", command);
-                int len = strlen(command);
-                char subbuff[len-2];
-                memcpy( subbuff, &command[1], len-2 );
-                subbuff[len-1] = '\0';
-                printf("%s\n", subbuff);
-                args[0] = "asd";
-                // fill arguments array with command
-                int init_size = strlen(subbuff);
-                char delim[] = " ";
-                char *ptr = strtok(subbuff, delim);
-                int ct = 0;
-                while(ptr != NULL)
-                {
-                    args[ct] = ptr;
-                    printf("%s\n", ptr);
-                    ptr = strtok(NULL, delim);
-                    ct++;
-                }
-                args[ct] = NULL;
-            }else{
-                bookmarkCommands(args);
-            }
+/*
+ * bg [-t DURATION] [%n]: let a stopped job go on running in the
+ * background. With -t it gets SIGTERM after DURATION, and SIGKILL if it
+ * is still there TIMEOUT_GRACE_NS later.
+ */
+int builtinBg(char **args) {
+    int64_t duration = -1;
+    int first = 1;
+    if(args[1] != NULL && strcmp(args[1], "-t") == 0){
+        duration = args[2] != NULL ? parseDuration(args[2]) : -1;
+        if(duration < 0){
+            fprintf(stderr, "bg: usage: bg [-t duration] [%%job]\n");
+            return 2;
         }
+        first = 3;
+    }
+    job *entry = findJobArgument("bg", args[first]);
+    if(entry == NULL){
+        return 1;
+    }
+    if(duration >= 0){
+        shellTimer timeout = {phaseClock() + duration, TIMER_JOB, entry, SIGTERM, TIMEOUT_GRACE_NS};
+        pushTimer(timeout);
+    }
+    continueJob(entry, 1);
+    printf("[%d]+ %s &\n", entry->id, entry->command);
+    return 0;
+}
 
-
-        int counter = 0;
-        while(args[counter] != NULL){
-            if (!strcmp(args[counter], "&")){
-                args[counter] = NULL;
+/*
+ * kill [-SIG | -s SIG] %n | pid ... A job is signalled process by process
+ * through the pidfds. A stopped job is continued after a terminating
+ * signal, so it can act on it.
+ */
+int builtinKill(char **args) {
+    int signal = SIGTERM;
+    int first = 1;
+    if(args[1] != NULL && strcmp(args[1], "-s") == 0 && args[2] != NULL){
+        signal = parseSignal(args[2]);
+        first = 3;
+    }else if(args[1] != NULL && args[1][0] == '-' && args[1][1] != '\0'){
+        signal = parseSignal(&args[1][1]);
+        first = 2;
+    }
+    if(signal == -1 || args[first] == NULL){
+        fprintf(stderr, "kill: usage: kill [-s sigspec | -sigspec] %%job | pid ...\n");
+        return 2;
+    }
+    int status = 0;
+    for(int i = first; args[i] != NULL; i++){
+        if(args[i][0] == '%'){
+            job *entry = findJobArgument("kill", args[i]);
+            if(entry == NULL){
+                status = 1;
+                continue;
             }
-            counter++;
+            for(backgroundProcess *process = entry->firstProcess; process != NULL; process = process->nextInJob){
+                signalProcess(process, signal);
+            }
+            if(entry->stoppedCount > 0 && signal != SIGSTOP && signal != SIGTSTP && signal != SIGCONT){
+                continueJob(entry, entry->background);
+            }
+            continue;
+        }
+        char *end;
+        pid_t pid = (pid_t)strtol(args[i], &end, 10);
+        backgroundProcess *process = *end == '\0' ? findBackgroundProcess(pid) : NULL;
+        int result = process != NULL ? signalProcess(process, signal) : *end == '\0' ? kill(pid, signal) : -1;
+        if(result == -1){
+            fprintf(stderr, "kill: %s: %s\n", args[i], *end == '\0' ? strerror(errno) : "not a pid or job");
+            status = 1;
         }
+    }
+    return status;
+}
 
-        if (strcmp(args[0], "exit") == 0){
-            checkAndExit();
+/*
+ * timeout [-s SIG] [-k GRACE] DURATION command [args]: run command in the
+ * foreground and send it SIG (SIGTERM) after DURATION, then SIGKILL after
+ * GRACE (5s, 0 for never). The deadlines are entries of the timer heap.
+ * Returns 124 when the command was timed out, as coreutils does. A builtin
+ * runs inside the shell and cannot be timed out.
+ */
+int builtinTimeout(char **args) {
+    int signal = SIGTERM;
+    int64_t grace = TIMEOUT_GRACE_NS;
+    int first = 1;
+    while(args[first] != NULL && args[first + 1] != NULL && args[first][0] == '-'){
+        if(strcmp(args[first], "-s") == 0){
+            signal = parseSignal(args[first + 1]);
+        }else if(strcmp(args[first], "-k") == 0){
+            grace = parseDuration(args[first + 1]);
+        }else{
+            break;
         }
+        first += 2;
+    }
+    int64_t duration = args[first] != NULL ? parseDuration(args[first]) : -1;
+    if(signal == -1 || grace < 0 || duration < 0 || args[first + 1] == NULL){
+        fprintf(stderr, "timeout: usage: timeout [-s signal] [-k grace] duration command [args]\n");
+        return 125;
+    }
 
-        // Fork a child from parent process
-        pid_t child = fork();
+    pipelineStage stage = {&args[first + 1], NULL, 0};
+    job *entry = executePipeline(&stage, 1, 0);
+    if(entry == NULL){
+        return lastExitStatus;
+    }
+    shellTimer timeout = {phaseClock() + duration, TIMER_JOB, entry, signal, (uint64_t)grace};
+    pushTimer(timeout);
+    parent_process(entry);
+    foreground = 0;
+    if(entry->runningCount == 0 && entry->timedOut){
+        int status = entry->lastProcess->status;
+        return WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL ? 128 + SIGKILL : 124;
+    }
+    return lastExitStatus;
+}
 
+/* Seconds with an optional fraction and an s, m, h or d suffix, in nanoseconds; -1 if malformed */
+int64_t parseDuration(const char *text) {
+    char *end;
+    double seconds = strtod(text, &end);
+    if(end == text || seconds < 0){
+        return -1;
+    }
+    if(*end == 'm'){
+        seconds *= 60;
+    }else if(*end == 'h'){
+        seconds *= 3600;
+    }else if(*end == 'd'){
+        seconds *= 86400;
+    }else if(*end != 's' && *end != '\0'){
+        return -1;
+    }
+    if(*end != '\0' && end[1] != '\0'){
+        return -1;
+    }
+    return (int64_t)(seconds * 1e9);
+}
 
-        // Set ID of Foregorund Process
-        if (background == 0){
-            foregroundProcessID = child;
-            foreground = 1;
+/*
+ * limit [--cpu N] [--mem SIZE] [--nofile N] command [args] runs command in
+ * the foreground under resource limits. The CPU and memory limits go into
+ * a cgroup of its own (cpu.max, memory.max) when a cgroup v2 directory is
+ * writable: $MYSHELL_CGROUP, or else the parent of the shell's cgroup,
+ * which must be delegated. Otherwise they become RLIMIT_AS and an
+ * affinity to N CPUs. --nofile is RLIMIT_NOFILE either way. rlimits
+ * cannot be given to posix_spawn(), so the command is forked.
+ */
+int builtinLimit(char **args) {
+    jobLimits limits = {0, 0, 0};
+    int first = 1;
+    while(args[first] != NULL && args[first + 1] != NULL && strncmp(args[first], "--", 2) == 0){
+        if(strcmp(args[first], "--cpu") == 0){
+            limits.cpus = strtod(args[first + 1], NULL);
+            if(limits.cpus <= 0) limits.cpus = -1;
+        }else if(strcmp(args[first], "--mem") == 0){
+            limits.memory = parseSize(args[first + 1]);
+        }else if(strcmp(args[first], "--nofile") == 0){
+            limits.nofile = atol(args[first + 1]);
+            if(limits.nofile <= 0) limits.nofile = -1;
+        }else{
+            limits.nofile = -1;     /* unknown option */
+            break;
         }
+        first += 2;
+    }
+    if(args[first] == NULL || limits.cpus < 0 || limits.memory < 0 || limits.nofile < 0){
+        fprintf(stderr, "limit: usage: limit [--cpu cpus] [--mem size] [--nofile count] command [args]\n");
+        return 2;
+    }
+    char *executable = lookupPath(args[first]);
+    if(executable == NULL){
+        fprintf(stderr, "%s: command not found\n", args[first]);
+        return 127;
+    }
 
-        // Handle problems during fork
-        if (child == -1) {
-            perror("Error occured during forking child.\n");
-            return -1;
+    char *cgroup = createJobCgroup(&limits);
+    // Only a limit run in the foreground takes the terminal, from a background group tcsetpgrp() stops it.
+    // Without the terminal the child stays in our group, where Control<c> reaches it
+    int terminal = jobControl && tcgetpgrp(STDIN_FILENO) == getpgrp() ? STDIN_FILENO : -1;
+    pid_t group = terminal != -1 ? 0 : -1;
+    fflush(NULL);
+    pid_t child = fork();
+    if(child == -1){
+        perror("limit");
+        if(cgroup != NULL){
+            rmdir(cgroup);
+            free(cgroup);
         }
+        return 1;
+    }
+    if(child == 0){
+        joinProcessGroup(group, terminal);
+        applyLimits(&limits, cgroup);
+        executeArgument(executable, &args[first]);
+    }
+    if(group != -1){
+        setpgid(child, child);
+    }
+
+    pipelineStage stage = {&args[first], NULL, 0};
+    job *entry = createJob(0, &stage, 1);
+    entry->processGroup = group != -1 ? child : 0;
+    entry->cgroup = cgroup;
+    createNewBackgroundProcess(entry, child);
+    foregroundJob = entry;
+    foreground = 1;
+    parent_process(entry);
+    foreground = 0;
+    return lastExitStatus;
+}
 
-        // Child Code
-        if (child == 0){
-            //printf("In child code.\n");
-            child_process(args);
+/* Bytes with an optional K, M, G or T suffix (powers of 1024); -1 if malformed */
+long long parseSize(const char *text) {
+    char *end;
+    double size = strtod(text, &end);
+    if(end == text || size <= 0){
+        return -1;
+    }
+    const char *units = "KMGT";
+    if(*end != '\0'){
+        const char *unit = strchr(units, *end & ~0x20);
+        if(unit == NULL || end[1] != '\0'){
+            return -1;
         }
-        // Parent Code
-        else{
-            //printf("In parent code.\n");
-            parent_process(child, background, args);
+        for(const char *scale = units; scale <= unit; scale++){
+            size *= 1024;
         }
-        /** the steps are:
-        (1) fork a child process using fork()
-        (2) the child process will invoke execv()
-        (3) if background == 0, the parent will wait,
-        otherwise it will invoke the setup() function again. */
     }
+    return (long long)size;
 }
 
-void initLinkedList() {
-    headRunningBackgroundProcess = malloc(sizeof(backgroundProcess));
-    headRunningBackgroundProcess->id = -1;
-    headRunningBackgroundProcess->nextBackgroundProcess = NULL;
-
-    headFinishedBackgroundProcess = malloc(sizeof(backgroundProcess));
-    headFinishedBackgroundProcess->id = -1;
-    headFinishedBackgroundProcess->nextBackgroundProcess = NULL;
+/*
+ * Make a cgroup for a job with limits on CPU or memory and write them into
+ * it. Returns its path, or NULL if there is no writable cgroup v2 directory
+ * with those controllers, in which case the child falls back to rlimits.
+ */
+char *createJobCgroup(jobLimits *limits) {
+    if(limits->cpus == 0 && limits->memory == 0){
+        return NULL;
+    }
+    char base[4096];
+    const char *configured = getenv("MYSHELL_CGROUP");
+    if(configured != NULL){
+        snprintf(base, sizeof(base), "%s", configured);
+    }else{
+        // The shell's own cgroup is not a leaf once it has job cgroups, so they go beside it
+        FILE *membership = fopen("/proc/self/cgroup", "r");
+        if(membership == NULL){
+            return NULL;
+        }
+        char line[4096];
+        char *path = NULL;
+        while(fgets(line, sizeof(line), membership) != NULL){
+            if(strncmp(line, "0::", 3) == 0){
+                path = &line[3];
+                path[strcspn(path, "\n")] = '\0';
+                break;
+            }
+        }
+        fclose(membership);
+        if(path == NULL){
+            return NULL;
+        }
+        char *parent = strrchr(path, '/');
+        if(parent != NULL){
+            *parent = '\0';
+        }
+        struct stat info;
+        const char *root = stat(CGROUP_ROOT "/cgroup.controllers", &info) == 0 ? CGROUP_ROOT : CGROUP_HYBRID_ROOT;
+        if(snprintf(base, sizeof(base), "%s%s", root, path) >= (int)sizeof(base)){
+            return NULL;
+        }
+    }
 
-    headBookmark = malloc(sizeof (bookmark));
-    headBookmark->command = "start";
-    headBookmark->nextBookmark = NULL;
+    size_t length = strlen(base) + 64;
+    char *cgroup = malloc(length);
+    snprintf(cgroup, length, "%s/myshell-%d-%d", base, (int)getpid(), jobCgroupCount++);
+    if(mkdir(cgroup, 0755) == -1){
+        free(cgroup);
+        return NULL;
+    }
+    char value[64];
+    int failed = 0;
+    if(limits->cpus > 0){
+        snprintf(value, sizeof(value), "%ld %d", (long)(limits->cpus * CGROUP_PERIOD), CGROUP_PERIOD);
+        failed |= writeCgroupFile(cgroup, "cpu.max", value);
+    }
+    if(limits->memory > 0){
+        snprintf(value, sizeof(value), "%lld", limits->memory);
+        failed |= writeCgroupFile(cgroup, "memory.max", value);
+    }
+    if(failed){
+        rmdir(cgroup);
+        free(cgroup);
+        return NULL;
+    }
+    return cgroup;
 }
 
-void fillPath() {
-
+/* Write value to an existing file of a cgroup directory; 0, or -1 on failure */
+int writeCgroupFile(const char *directory, const char *file, const char *value) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if(fd == -1){
+        return -1;
+    }
+    ssize_t written = write(fd, value, strlen(value));
+    close(fd);
+    return written == (ssize_t)strlen(value) ? 0 : -1;
 }
 
-void parent_process(pid_t child, int background, char *pString[41]) {
-    // If it is a foreground process, wait for the child.
-    if(background == 0){
-        wait(child);
+/*
+ * In the child of limit, before exec: move into the job cgroup, or apply
+ * the CPU and memory limits as an affinity mask and RLIMIT_AS if that is
+ * not possible. A limit that cannot be set ends the child with 126.
+ */
+void applyLimits(jobLimits *limits, const char *cgroup) {
+    int placed = cgroup != NULL && writeCgroupFile(cgroup, "cgroup.procs", "0") == 0;
+    if(limits->nofile > 0){
+        struct rlimit files = {limits->nofile, limits->nofile};
+        if(setrlimit(RLIMIT_NOFILE, &files) == -1){
+            fprintf(stderr, "limit: nofile: %s\n", strerror(errno));
+            exit(126);
+        }
     }
-    /*
-     * If it is a background process,
-     * create a new struct for the child process
-     * add the process to the background process linked list
-     *
-    */
-    else{
-        printf("child id    : %ld\n", child);
-        createNewBackgroundProcess(child);
-        waitpid(-1, NULL, WNOHANG);
+    if(limits->memory > 0 && !placed){
+        struct rlimit memory = {limits->memory, limits->memory};
+        if(setrlimit(RLIMIT_AS, &memory) == -1){
+            fprintf(stderr, "limit: mem: %s\n", strerror(errno));
+            exit(126);
+        }
+    }
+    if(limits->cpus > 0 && !placed){
+        // Keep the first N of the CPUs the shell may use, at least one
+        cpu_set_t allowed;
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        int keep = (int)limits->cpus;
+        if(keep < limits->cpus || keep == 0){
+            keep++;
+        }
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+            if(CPU_ISSET(cpu, &allowed) && keep-- <= 0){
+                CPU_CLR(cpu, &allowed);
+            }
+        }
+        sched_setaffinity(0, sizeof(allowed), &allowed);
     }
 }
 
-void createNewBackgroundProcess(pid_t child) {
-    backgroundProcess *newBackgroundProcess = malloc(sizeof (backgroundProcess));
-    newBackgroundProcess->id = child;
-    newBackgroundProcess->nextBackgroundProcess = NULL;
-    addNewBackgroundProcess(headRunningBackgroundProcess, newBackgroundProcess);
+/* In a forked child: join the job's process group (-1 for none) and take the terminal if given */
+void joinProcessGroup(pid_t group, int terminal) {
+    if(group == -1){
+        return;
+    }
+    setpgid(0, group);
+    if(terminal != -1){
+        tcsetpgrp(terminal, getpgrp());
+    }
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
 }
 
-void addNewBackgroundProcess(backgroundProcess *root, backgroundProcess *process) {
-    backgroundProcess *iter = root;
-    while (iter->nextBackgroundProcess != NULL){
-        iter = iter->nextBackgroundProcess;
+/* %n, n or nothing for the most recent job; NULL after reporting a missing one */
+job *findJobArgument(const char *name, const char *argument) {
+    if(argument == NULL){
+        if(runningJobs.tail == NULL){
+            fprintf(stderr, "%s: no current job\n", name);
+        }
+        return runningJobs.tail;
+    }
+    int id = atoi(argument[0] == '%' ? &argument[1] : argument);
+    for(job *entry = runningJobs.head; entry != NULL; entry = entry->nextJob){
+        if(entry->id == id){
+            return entry;
+        }
     }
-    iter->nextBackgroundProcess = process;
+    fprintf(stderr, "%s: %s: no such job\n", name, argument);
+    return NULL;
 }
 
-void moveBackgroundProcessToFinished(backgroundProcess *process) {
-    // Find the process
-    backgroundProcess *iter = headRunningBackgroundProcess;
-    while (iter->nextBackgroundProcess != process){
-        iter = iter->nextBackgroundProcess;
+/* Send SIGCONT to the stopped processes of a job, in the foreground it gets the terminal first */
+void continueJob(job *entry, int background) {
+    entry->background = background;
+    if(!background && jobControl && entry->processGroup != 0){
+        tcsetpgrp(STDIN_FILENO, entry->processGroup);
+    }
+    for(backgroundProcess *process = entry->firstProcess; process != NULL; process = process->nextInJob){
+        if(process->stopped){
+            signalProcess(process, SIGCONT);
+            process->stopped = 0;
+            entry->stoppedCount--;
+        }
     }
-    // Remove process from the list
-    iter = iter->nextBackgroundProcess;
-    iter->nextBackgroundProcess = process->nextBackgroundProcess;
-    addNewBackgroundProcess(headFinishedBackgroundProcess, process);
 }
 
-void child_process(char *pString[41]) {
-    // Output
-    int inputOutputFlag;
-    inputOutputFlag = checkInputOutput(pString);
-    if(inputOutputFlag == 0){
-        truncateOutput();    // >
+/* A signal number, or a name with or without SIG; -1 if unknown */
+int parseSignal(const char *text) {
+    if(text[0] >= '0' && text[0] <= '9'){
+        return atoi(text);
     }
-    else if(inputOutputFlag == 1){
-        appendOutput();    // >>
+    if(strncmp(text, "SIG", 3) == 0){
+        text += 3;
     }
-    else if(inputOutputFlag == 2){
-        getInput();    // <
+    for(size_t i = 0; i < sizeof(signalNames) / sizeof(signalNames[0]); i++){
+        if(strcasecmp(text, signalNames[i].name) == 0){
+            return signalNames[i].number;
+        }
     }
-    else if(inputOutputFlag == 3){
-        outputError();  // Error
+    return -1;
+}
+
+/*
+ * Run the argument vectors from next with at most limit children in
+ * flight. The children are in the job table, pinned there until looked at;
+ * a new one starts as soon as the event loop reaps one. With job control
+ * they share a process group that has the terminal, so Control<c> and
+ * Control<z> reach the whole batch. With nullInput stdin of the children is
+ * /dev/null, as it is where the items come from. Returns the number of
+ * failures, capped at PARALLEL_MAX_FAILURES, or 128 plus the signal once a
+ * child was interrupted or every running one stopped.
+ */
+int runBatches(const char *name, char *executable, long limit, int nullInput, batchSource next, void *state) {
+    parallelSlot *slots = calloc(limit, sizeof(parallelSlot));
+    if(slots == NULL){
+        perror(name);
+        return 1;
     }
-    // Print situtations of processes
-    if (strcmp(pString[0], "ps_all") == 0){
-        printProcesses();
+    int inputFd = -1;
+    if(nullInput){
+        inputFd = nullInputFd != -1 ? nullInputFd : open("/dev/null", O_RDONLY | O_CLOEXEC);
     }
-    // Search PATH Variable and run execute argument
-    executeArgument(pString);
+    fflush(stdout);
+    int wasForeground = foreground;
+    foreground = 1;
+
+    // A group of their own needs the terminal for Control<c>, with stdin redirected they stay in ours
+    int ownGroup = jobControl && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    pid_t group = 0;
+    int terminalGiven = 0;
+    int running = 0;
+    int failures = 0;
+    int exhausted = 0;
+    int interrupted = 0;
+    int stopped = 0;
+    while(1){
+        // Fill every free slot, a group is only joined while one of its members is unreaped
+        if(running == 0){
+            group = 0;
+        }
+        for(long slot = 0; slot < limit && !exhausted && !interrupted; slot++){
+            if(slots[slot].process != NULL){
+                continue;
+            }
+            char **argv = next(state);
+            if(argv == NULL){
+                exhausted = 1;
+                break;
+            }
+            pipelineStage stage = {argv, NULL, 0};
+            pid_t child = spawnProcess(executable, &stage, inputFd, -1, ownGroup ? group : -1,
+                                       ownGroup && group == 0 ? STDIN_FILENO : -1);
+            if(child == -1){
+                failures++;
+                free(argv);
+                continue;
+            }
+            if(ownGroup && group == 0){
+                group = child;
+                terminalGiven = 1;
+            }
+            job *entry = createJob(0, &stage, 1);
+            entry->pinned = 1;
+            entry->processGroup = ownGroup ? group : 0;
+            slots[slot].process = createNewBackgroundProcess(entry, child);
+            slots[slot].argv = argv;
+            running++;
+        }
+        if(running == 0){
+            break;
+        }
 
+        // Sleep until a child is reaped or stops
+        runEvents(-1);
+        int stoppedCount = 0;
+        for(long slot = 0; slot < limit; slot++){
+            backgroundProcess *process = slots[slot].process;
+            if(process == NULL || process->running){
+                stoppedCount += process != NULL && process->stopped;
+                continue;
+            }
+            int status = process->status;
+            int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            if(WIFSIGNALED(status) && WTERMSIG(status) == SIGINT){
+                interrupted = 1;    /* no new items after Control<c> */
+            }else if(code != 0){
+                fprintf(stderr, "%s: %s: exit %d\n", name, slots[slot].argv[0], code);
+                failures++;
+            }
+            process->owner->pinned = 0;
+            free(slots[slot].argv);
+            slots[slot].process = NULL;
+            running--;
+        }
+        // Like waitForJob(): once all of them stopped, they stay in the job table for fg and bg
+        if(running > 0 && stoppedCount == running){
+            stopped = 1;
+            break;
+        }
+    }
+    if(terminalGiven){
+        tcsetpgrp(STDIN_FILENO, shellGroup);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shellModes);
+    }
+    if(stopped){
+        printf("\n");
+        for(long slot = 0; slot < limit; slot++){
+            if(slots[slot].process != NULL){
+                job *entry = slots[slot].process->owner;
+                entry->pinned = 0;
+                entry->background = 1;
+                printf("[%d]+  Stopped\t%s\n", entry->id, entry->command);
+                free(slots[slot].argv);
+            }
+        }
+    }else if(interrupted && !batchMode){
+        printf("\n");     /* the prompt goes below the ^C */
+    }
+    foreground = wasForeground;
+    free(slots);
+    if(inputFd != -1 && inputFd != nullInputFd){
+        close(inputFd);
+    }
+    if(stopped || interrupted){
+        return 128 + (stopped ? SIGTSTP : SIGINT);
+    }
+    return failures > PARALLEL_MAX_FAILURES ? PARALLEL_MAX_FAILURES : failures;
 }
 
-int outputError() {
-    int fd;
-    fd = open(OUTPUT_FILE,CREATE_FLAGS,CREATE_MODE);
-    if(fd == -1){
-        perror("Failed to open file");
-        return 1;
+/* Copy prefix and items into one allocation laid out as a NULL terminated vector */
+char **makeBatch(char **prefix, int prefixLength, char **items, int itemCount) {
+    size_t strings = 0;
+    for(int i = 0; i < itemCount; i++){
+        strings += strlen(items[i]) + 1;
     }
-    if(dup2(fd,STDERR_FILENO) == -1){
-        perror("Failed to redirect standart output");
-        return 1;
+    char **argv = malloc((prefixLength + itemCount + 1) * sizeof(char *) + strings);
+    if(argv == NULL){
+        return NULL;
     }
-    if(close(fd) == -1){
-        perror("Failed to close the file");
-        return 1;
+    char *text = (char *)&argv[prefixLength + itemCount + 1];
+    memcpy(argv, prefix, prefixLength * sizeof(char *));
+    for(int i = 0; i < itemCount; i++){
+        size_t length = strlen(items[i]) + 1;
+        argv[prefixLength + i] = memcpy(text, items[i], length);
+        text += length;
     }
+    argv[prefixLength + itemCount] = NULL;
+    return argv;
 }
 
-int appendOutput() {
-    int fd;
-    fd = open(OUTPUT_FILE,CREATE_APPENDFLAGS,CREATE_MODE);
-    if(fd == -1){
-        perror("Failed to open file");
-        return 1;
+/* The command with the next item of parallel, from after ::: or a line of stdin */
+char **nextParallelItem(void *state) {
+    parallelItems *items = state;
+    if(items->items != NULL){
+        if(items->items[items->index] == NULL){
+            return NULL;
+        }
+        return makeBatch(items->prefix, items->prefixLength, &items->items[items->index++], 1);
     }
-    if(dup2(fd,STDOUT_FILENO) == -1){
-        perror("Failed to redirect standart output");
-        return 1;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length = getline(&line, &capacity, stdin);
+    if(length == -1){
+        free(line);
+        clearerr(stdin);
+        return NULL;
     }
-    if(close(fd) == -1){
-        perror("Failed to close the file");
-        return 1;
+    if(length > 0 && line[length - 1] == '\n'){
+        line[length - 1] = '\0';
     }
+    char **argv = makeBatch(items->prefix, items->prefixLength, &line, 1);
+    free(line);
+    return argv;
 }
 
-void bookmarkCommands(char **pString) {
-    // Add new bookmark
-    if(pString[1][0] == '"'){
-        char* command =prepareCommand(pString);
-        addNewBookmark(headBookmark, command);
+/* Read items until the next one would not fit in the same exec, and pack them */
+char **nextXargsBatch(void *state) {
+    xargsItems *items = state;
+    char **batch = NULL;
+    int count = 0;
+    int capacity = 0;
+    size_t used = 0;
+    while(items->maxItems == 0 || count < items->maxItems){
+        if(items->pending == NULL){
+            size_t capacity = 0;
+            ssize_t length = getdelim(&items->pending, &capacity, items->delimiter, stdin);
+            if(length == -1){
+                free(items->pending);
+                items->pending = NULL;
+                clearerr(stdin);
+                break;
+            }
+            if(length > 0 && items->pending[length - 1] == items->delimiter){
+                items->pending[--length] = '\0';
+            }
+            if(length == 0){
+                free(items->pending);
+                items->pending = NULL;
+                continue;   /* empty lines are not items */
+            }
+            items->pendingLength = length;
+        }
+        size_t cost = items->pendingLength + 1 + sizeof(char *);
+        if(count > 0 && used + cost > items->budget){
+            break;      /* starts the next batch; an item too big on its own still runs alone */
+        }
+        if(count == capacity){
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            batch = realloc(batch, capacity * sizeof(char *));
+        }
+        batch[count++] = items->pending;
+        items->pending = NULL;
+        used += cost;
+    }
+    char **argv = count == 0 ? NULL : makeBatch(items->prefix, items->prefixLength, batch, count);
+    for(int i = 0; i < count; i++){
+        free(batch[i]);
     }
+    free(batch);
+    return argv;
+}
+
+void bookmarkCommands(char **pString) {
     // Delete a bookmark
-    else if(strcmp(pString[1], "-d") == 0){
-        deleteBookmark(headBookmark, atoi(pString[2]));
+    if(strcmp(pString[1], "-d") == 0 && pString[2] != NULL){
+        deleteBookmark(atoi(pString[2]));
     }
     // List bookmarks
     else if(strcmp(pString[1], "-l") == 0){
-        listBookmarks(headBookmark);
+        listBookmarks();
+    }
+    // Bookmark an entry of the history
+    else if(strcmp(pString[1], "-h") == 0 && pString[2] != NULL){
+        promoteHistory(atol(pString[2]));
+    }
+    // Add new bookmark, the quotes were already removed by the lexer
+    else if(pString[1][0] != '-'){
+        char* command =prepareCommand(pString);
+        addNewBookmark(command);
+        free(command);
     }
 }
 
-char *prepareCommand(char **pString) {
-        int counter = 1;
-        char *command = "";
-        int temp;
-        char* name_with_extension;
-        while(pString[counter] != '\0'){
-            temp = counter + 1;
-            if(pString[temp] != '\0'){
-                name_with_extension = malloc(strlen(command)+1+4);
-                strcpy(name_with_extension, command); /* copy name into the new var */
-                strcat(name_with_extension, pString[counter]); /* add the extension */
-                strcat(name_with_extension, " "); /* add the extension */
-                counter++;
-            } else {
-                strcat(name_with_extension, pString[counter]); /* add the extension */
-                counter++;
-            }
+/*
+ * bookmark -i with redirections, in a pipeline or after other commands on
+ * the line: run the stored command from the builtin, so its output goes
+ * where the builtin's goes. Returns the status of its last pipeline.
+ */
+int runBookmark(const char *argument) {
+    static commandLine lines[BOOKMARK_MAX_DEPTH];
+    static int depth = 0;
+    if(argument == NULL){
+        fprintf(stderr, "bookmark: usage: bookmark -i index\n");
+        return 2;
+    }
+    if(depth == BOOKMARK_MAX_DEPTH){
+        fprintf(stderr, "bookmark: bookmarks nested too deeply\n");
+        return 1;
+    }
+    commandLine *line = &lines[depth];
+    if(line->args.memory == NULL){
+        initCommandLine(line);
+    }
+    resetCommandLine(line);
+    int index = atoi(argument);
+    // The command is echoed to stderr, stdout may be the builtin's redirection
+    if(loadBookmark(index, line, stderr) == -1){
+        fprintf(stderr, "bookmark: no bookmark %d\n", index);
+        return 1;
+    }
+    if(line->pipelineCount == 0){
+        if(line->error[0] != '\0'){
+            fprintf(stderr, "%s\n", line->error);
         }
-    return name_with_extension;
+        return 2;
+    }
 
-    /*
-    int counter = 1;
-    char *command = "";
-    int temp;
-    while(pString[counter] != NULL){
-        temp = counter + 1;
-        if(pString[temp] != NULL){
-            sprintf(command,"%s ",pString[counter]);
-        } else {
-            sprintf(command,"%s",pString[counter]);
+    depth++;
+    lastExitStatus = 0;
+    for(int i = 0; i < line->pipelineCount; i++){
+        pipeline *next = &line->pipelines[i];
+        if(next->connector == CONNECT_AND && lastExitStatus != 0){
+            continue;
+        }
+        job *newJob = executePipeline(&line->stages[next->firstStage], next->stageCount, next->background);
+        if(newJob != NULL){
+            parent_process(newJob);
+            foreground = 0;
+        }
+    }
+    depth--;
+    return lastExitStatus;
+}
+
+/*
+ * Join the words after "bookmark" back into one command line. A lone word
+ * is the quoted command itself and is kept as it is. Of several words, those
+ * the lexer would split or treat as operators are single quoted, so the
+ * bookmark runs with the same arguments.
+ */
+char *prepareCommand(char **pString) {
+    if(pString[2] == NULL){
+        return strdup(pString[1]);
+    }
+    size_t length = 1;
+    for(int counter = 1; pString[counter] != NULL; counter++){
+        length += strlen(pString[counter]) * 4 + 3;    /* every ' becomes '\'' */
+    }
+    char *command = malloc(length);
+    char *end = command;
+    for(int counter = 1; pString[counter] != NULL; counter++){
+        const char *word = pString[counter];
+        if(counter > 1){
+            *end++ = ' ';
+        }
+        int quote = word[0] == '\0';
+        for(const char *c = word; *c && !quote; c++){
+            quote = delimiterTable[(unsigned char)*c];
+        }
+        if(!quote){
+            end = stpcpy(end, word);
+            continue;
+        }
+        *end++ = '\'';
+        for(const char *c = word; *c; c++){
+            if(*c == '\''){
+                end = stpcpy(end, "'\\''");
+            }else{
+                *end++ = *c;
+            }
         }
-    }*/
+        *end++ = '\'';
+    }
+    *end = '\0';
+    return command;
 }
 
 void checkAndExit() {
     // Check if there is any running background procecess, if any notify the user
-    if (headRunningBackgroundProcess->nextBackgroundProcess != NULL){
+    reapChildren();
+    if (runningJobs.count != 0){
         printf("There is still background processes running!\nPlease terminate all background processes to exit from shell.\n");
     }else{
         exit(1);
     }
 }
 
-void executeArgument(char **pString) {
-    const char* string = getenv("PATH");
-    // Split string code taken from https://www.educative.io/edpresso/splitting-a-string-using-strtok-in-c
-    // Extract the first token
-    char * token = strtok(string, ":");
-    char tempToRun[80];
-    // loop through the string to extract all other tokens
-    while( token != NULL ) {
-        strcpy(tempToRun, token);
-        sprintf(tempToRun,"%s/%s",token,pString[0]);
-        execv(tempToRun, pString);
-        strcpy(tempToRun, "");
-        token = strtok(NULL, ":");
+void executeArgument(char *executable, char **pString) {
+    if(executable == NULL){
+        fprintf(stderr, "%s: command not found\n", pString[0]);
+        exit(127);
     }
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    execve(executable, pString, environ);
+    perror(pString[0]);
+    exit(errno == ENOENT ? 127 : 126);
 }
 
-void printProcesses() {
-    // 1. Iterate all processes and move if any of them has finished
+/*
+ * Launch an external command without fork(). glibc implements posix_spawn()
+ * with clone(CLONE_VM|CLONE_VFORK), so the shell's page tables are never
+ * copied. Pipe ends and the stage's redirection plan become file actions,
+ * in the same order runRedirections() would carry them out. group is -1
+ * to stay in the shell's process group, 0 for a new one or the group to
+ * join; a terminal fd other than -1 is handed to that group before exec.
+ * Returns the child's pid, or -1 after printing the reason.
+ */
+pid_t spawnProcess(char *executable, pipelineStage *stage, int inputFd, int outputFd, pid_t group, int terminal) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if(group != -1){
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&spawnAttributes, group);
+        if(terminal != -1){
+            // Before exec, so the job cannot read the terminal while still in the background
+            posix_spawn_file_actions_addtcsetpgrp_np(&actions, terminal);
+        }
+    }
+    posix_spawnattr_setflags(&spawnAttributes, flags);
+    if(inputFd == -1){
+        inputFd = nullInputFd;
+    }
+    if(inputFd != -1){
+        posix_spawn_file_actions_adddup2(&actions, inputFd, STDIN_FILENO);
+    }
+    if(outputFd != -1){
+        posix_spawn_file_actions_adddup2(&actions, outputFd, STDOUT_FILENO);
+    }
 
-    /*
-    backgroundProcess *iter = headRunningBackgroundProcess->nextBackgroundProcess;
-    while (iter != NULL){
-        if(kill(iter->id, 0) != -1) {
-            printf("Kapattığım: %d\n", iter->id);
-            //printf("%d\n",waitpid(iter->id, NULL, WNOHANG));
-           // backgroundProcess *temp = iter;
-            //iter = iter->nextBackgroundProcess;
-           // moveBackgroundProcessToFinished(temp);
-            //continue;
+    for(int i = 0; i < stage->planLength; i++){
+        fdOperation *step = &stage->plan[i];
+        int error;
+        if(step->operation == FD_OPEN){
+            error = posix_spawn_file_actions_addopen(&actions, step->fd, step->file, step->flags, CREATE_MODE);
+        }else if(step->operation == FD_DUP){
+            error = posix_spawn_file_actions_adddup2(&actions, step->source, step->fd);
+        }else{
+            error = posix_spawn_file_actions_addclose(&actions, step->fd);
+        }
+        if(error != 0){
+            fprintf(stderr, "%d: %s\n", step->fd, strerror(error));
+            posix_spawn_file_actions_destroy(&actions);
+            return -1;
         }
-        iter = iter->nextBackgroundProcess;
     }
-    */
+
+    pid_t child;
+    int error = posix_spawn(&child, executable, &actions, &spawnAttributes, stage->args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if(error != 0){
+        // A remembered path that went away: the next lookup checks the PATH directories
+        if(error == ENOENT && executable != stage->args[0]){
+            pathCheckedAt = 0;
+        }
+        fprintf(stderr, "%s: %s\n", stage->args[0], strerror(error));
+        return -1;
+    }
+    return child;
+}
+
+void printProcesses() {
+    // 1. Reap every process that has finished
+    reapChildren();
 
     // 2. Print running processes
     printf("\nRunning\n");
 
-    backgroundProcess *iterRunning = headRunningBackgroundProcess->nextBackgroundProcess;
+    job *iterRunning = runningJobs.head;
 
     if(iterRunning == NULL){
         printf("There is no running processes!\n");
     }
     int counter = 1;
     while (iterRunning != NULL){
-        printf("%d. (Pid=%d)\n", counter, iterRunning->id);
-        iterRunning = iterRunning->nextBackgroundProcess;
-        counter++;
+        for(backgroundProcess *process = iterRunning->firstProcess; process != NULL; process = process->nextInJob){
+            if(process->running){
+                printf("%d. (Pid=%d) [%d] %s\n", counter, process->id, iterRunning->id, iterRunning->command);
+                counter++;
+            }
+        }
+        iterRunning = iterRunning->nextJob;
     }
 
-    /*
     // 3. Print finished processes
     printf("Finished\n");
-    backgroundProcess *iterFinished = headFinishedBackgroundProcess->nextBackgroundProcess;
+    job *iterFinished = finishedJobs.head;
     if(iterFinished == NULL){
         printf("There is no finished processes!\n");
     }
     counter = 1;
-    while (iterRunning != NULL){
-        printf("%d. (Pid=%d)\n", counter,iterFinished->id);
-        iterFinished = iterFinished->nextBackgroundProcess;
-        counter++;
-    }*/
-
-}
-
-void control_z(int signal) {
-    // Check if there is any foreground process
-    if(foreground==1){
-        // Kill the process
-        kill(foregroundProcessID, SIGKILL);
-        printf("\nCurrent foreground processes successfully killed.\n");
-        // Update the global variable to check later
-        foreground=0;
-    }else{
-        // Print to user that there is no running foreground process.
-        printf("\nThere is no running foreground process.\nmyshell> ");
-    }
-    fflush(stdout);
-}
-
-void addNewBookmark(bookmark *root, char* command){
-    bookmark *newBookmark = malloc(sizeof (bookmark));
-    newBookmark->command = command;
-    newBookmark->nextBookmark = NULL;
-
-    bookmark *iter = root;
-    while (iter->nextBookmark != NULL){
-        iter = iter->nextBookmark;
-    }
-    iter->nextBookmark = newBookmark;
-}
-
-void deleteBookmark(bookmark *root, int index){
-    bookmark *iter = root;
-    while(index != 0){
-        iter = iter->nextBookmark;
-        index--;
-    }
-    bookmark *temp = iter->nextBookmark;
-    iter->nextBookmark = temp->nextBookmark;
-    free(temp);
-}
-
-void listBookmarks(bookmark *root){
-    bookmark *iter = root->nextBookmark;
-    int counter = 0;
-    while (iter != NULL){
-        printf("%d %s\n",counter, iter->command);
-        counter++;
-        iter = iter->nextBookmark;
+    while (iterFinished != NULL){
+        for(backgroundProcess *process = iterFinished->firstProcess; process != NULL; process = process->nextInJob){
+            if(WIFSIGNALED(process->status)){
+                printf("%d. (Pid=%d) [%d] %s (signal %d)\n", counter, process->id, iterFinished->id,
+                       iterFinished->command, WTERMSIG(process->status));
+            }else{
+                printf("%d. (Pid=%d) [%d] %s (exit %d)\n", counter, process->id, iterFinished->id,
+                       iterFinished->command, WEXITSTATUS(process->status));
+            }
+            printf("   ");
+            printUsage(stdout, elapsedSeconds(&iterFinished->started, &process->finished), &process->usage);
+            counter++;
+        }
+        iterFinished = iterFinished->nextJob;
     }
-}
 
-char *findCommand(int index) {
-    bookmark *iter = headBookmark;
-    int counter = index + 1;
-    while(counter != 0){
-        iter = iter->nextBookmark;
-        counter--;
-    }
-    return iter->command;
 }
 
-int truncateOutput() {
-    int fd;
-    fd = open(OUTPUT_FILE, CREATE_FLAGS, CREATE_MODE);
-    if (fd == -1) {
-        perror("Failed to open my.file");
-        return 1;
+/*
+ * Control<z> that reached the shell itself. A foreground job gets it from
+ * the terminal and stops, which waitForJob() notices.
+ */
+void control_z() {
+    if(foreground == 1){
+        return;
     }
-    if (dup2(fd, STDOUT_FILENO) == -1) {
-        perror("Failed to redirect standard output");
-        return 1;
-    }
-    if (close(fd) == -1) {
-        perror("Failed to close the file");
-        return 1;
-    }
-    printf("Output will be seen in my.file\n");
+    // Print to user that there is no running foreground process.
+    printf("\nThere is no running foreground process.\nmyshell> ");
+    fflush(stdout);
 }
-
-int checkInputOutput(char **args) {
-    int counter = 0;
-    while(args[counter]!=NULL){
-        // OUTPUT
-        if( strcmp(args[counter],">") == 0 ){
-            strcpy(OUTPUT_FILE,args[counter+1]);
-            return 0;
-        }else if( strcmp(args[counter],">>") == 0 ){
-            strcpy(OUTPUT_FILE,args[counter+1]);
-            return 1;
-        }
-
-        // INPUT
-        if( strcmp(args[counter],"<") == 0 ){
-            strcpy(INPUT_FILE , args[counter+1]);
-            return 2;
-        }
-
-        // ERROR
-        if( strcmp(args[counter],"2>") == 0 ){
-            strcpy(OUTPUT_FILE,args[counter+1]);
-            return 3;
-        }
-        args[counter]=NULL;
-        args[counter+1]=NULL;
-        counter++;
-    }
-    return -1;
-}
\ No newline at end of file
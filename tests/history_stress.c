@@ -0,0 +1,116 @@
+/*
+ * History stress test: N writer processes add numbered entries to one
+ * shared history at the same time through addHistory(). Afterwards every
+ * entry number must hold exactly one of them, read back through the ring
+ * for the latest entries and through the log for the older ones.
+ *
+ * usage: history_stress [writers] [entries per writer]
+ */
+#define SHELL_NO_MAIN
+#include "../main.c"
+
+static const char *historyFiles[] = {HISTORY_FILE, HISTORY_INDEX_FILE, HISTORY_RING_FILE};
+
+static void removeHistory(const char *home) {
+    char path[4096];
+    for(size_t i = 0; i < sizeof(historyFiles) / sizeof(historyFiles[0]); i++){
+        snprintf(path, sizeof(path), "%s/%s", home, historyFiles[i]);
+        unlink(path);
+    }
+    rmdir(home);
+}
+
+/* Wait for the start signal, then add entries "writer W entry E" as fast as possible */
+static void runWriter(int writer, long entries, int start) {
+    char ready;
+    initHistory();
+    if(read(start, &ready, 1) == -1){
+        _exit(1);
+    }
+    for(long entry = 0; entry < entries; entry++){
+        char text[64];
+        snprintf(text, sizeof(text), "writer %d entry %ld", writer, entry);
+        addHistory(text);
+    }
+    _exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    int writers = argc > 1 ? atoi(argv[1]) : 8;
+    long entries = argc > 2 ? atol(argv[2]) : 5000;
+    if(writers < 1 || entries < 1){
+        fprintf(stderr, "usage: history_stress [writers] [entries per writer]\n");
+        return 2;
+    }
+    char home[] = "/tmp/history_stress.XXXXXX";
+    if(mkdtemp(home) == NULL){
+        perror("mkdtemp");
+        return 1;
+    }
+    setenv("HOME", home, 1);
+
+    // The writers all start when the pipe is closed, so they race from the first entry
+    int start[2];
+    if(pipe(start) == -1){
+        perror("pipe");
+        return 1;
+    }
+    for(int writer = 0; writer < writers; writer++){
+        pid_t child = fork();
+        if(child == -1){
+            perror("fork");
+            return 1;
+        }
+        if(child == 0){
+            close(start[1]);
+            runWriter(writer, entries, start[0]);
+        }
+    }
+    close(start[0]);
+    close(start[1]);
+    int failed = 0;
+    int status;
+    while(wait(&status) > 0){
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+
+    initHistory();
+    long total = (long)writers * entries;
+    long found = historyEntries();
+    unsigned char *seen = calloc(total, 1);
+    long missing = 0;
+    long duplicate = 0;
+    for(long number = 0; number < found; number++){
+        size_t length;
+        const char *text = historyText(number, &length);
+        int writer;
+        long entry;
+        char copy[64];
+        if(text == NULL || length >= sizeof(copy)){
+            missing++;
+            continue;
+        }
+        memcpy(copy, text, length);
+        copy[length] = '\0';
+        if(sscanf(copy, "writer %d entry %ld", &writer, &entry) != 2 || writer < 0 || writer >= writers
+           || entry < 0 || entry >= entries){
+            fprintf(stderr, "entry %ld is garbled: %s\n", number, copy);
+            missing++;
+            continue;
+        }
+        duplicate += seen[(long)writer * entries + entry]++ > 0;
+    }
+    for(long i = 0; i < total; i++){
+        missing += seen[i] == 0;
+    }
+    free(seen);
+    removeHistory(home);
+
+    printf("%d writers, %ld entries each: %ld numbered, %ld missing, %ld duplicated\n",
+           writers, entries, found, missing, duplicate);
+    if(failed || found != total || missing > 0 || duplicate > 0){
+        fprintf(stderr, "history lost or repeated entries\n");
+        return 1;
+    }
+    return 0;
+}
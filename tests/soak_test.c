@@ -0,0 +1,156 @@
+/*
+ * Soak test: feed a million command lines to the shell through a pipe and
+ * check that its resident set stays flat once it has warmed up. The lines
+ * mix builtins, redirections, quoting, bookmarks and a few background
+ * jobs, so the line arena, the bookmark and job slabs are all cycled.
+ *
+ * usage: soak_test SHELL [lines]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SOAK_LINES 1000000
+#define SOAK_SAMPLES 10
+#define SOAK_SLACK_KB 256  /* growth allowed after the first sample */
+
+static const char *soakLines[] = {
+    "cd .\n",
+    "pwd > /dev/null\n",
+    "cd \"/tmp\" ; cd '/' 2> /dev/null\n",
+    "bookmark \"cd .\"\n",
+    "bookmark -d 0\n",
+    "hash cd pwd bookmark\n",
+};
+
+/* VmRSS of pid in KB, -1 if it cannot be read */
+static long residentKb(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *status = fopen(path, "r");
+    if(status == NULL){
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    while(fgets(line, sizeof(line), status) != NULL){
+        if(sscanf(line, "VmRSS: %ld", &kb) == 1){
+            break;
+        }
+    }
+    fclose(status);
+    return kb;
+}
+
+static int writeAll(int fd, const char *text, size_t length) {
+    while(length > 0){
+        ssize_t written = write(fd, text, length);
+        if(written == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        text += written;
+        length -= written;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 2){
+        fprintf(stderr, "usage: soak_test SHELL [lines]\n");
+        return 2;
+    }
+    long lines = argc > 2 ? atol(argv[2]) : SOAK_LINES;
+    if(lines < SOAK_SAMPLES){
+        lines = SOAK_SAMPLES;
+    }
+    char home[] = "/tmp/soak_test.XXXXXX";
+    if(mkdtemp(home) == NULL){
+        perror("mkdtemp");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int commands[2];
+    if(pipe(commands) == -1){
+        perror("pipe");
+        return 1;
+    }
+    pid_t shell = fork();
+    if(shell == 0){
+        dup2(commands[0], STDIN_FILENO);
+        close(commands[0]);
+        close(commands[1]);
+        freopen("/dev/null", "w", stdout);
+        setenv("HOME", home, 1);
+        execl(argv[1], argv[1], (char *)NULL);
+        perror(argv[1]);
+        _exit(127);
+    }
+    close(commands[0]);
+
+    // A batch buffer of lines, with a background job once per batch
+    char batch[4096];
+    size_t used = 0;
+    long perBatch = 0;
+    size_t lineCount = sizeof(soakLines) / sizeof(soakLines[0]);
+    while(used + 64 < sizeof(batch)){
+        const char *line = soakLines[perBatch % lineCount];
+        memcpy(batch + used, line, strlen(line));
+        used += strlen(line);
+        perBatch++;
+    }
+    const char *job = "true &\n";
+    memcpy(batch + used, job, strlen(job));
+    used += strlen(job);
+    perBatch++;
+
+    long samples[SOAK_SAMPLES];
+    long sent = 0;
+    for(int sample = 0; sample < SOAK_SAMPLES; sample++){
+        long target = lines / SOAK_SAMPLES * (sample + 1);
+        for(; sent < target; sent += perBatch){
+            if(writeAll(commands[1], batch, used) == -1){
+                perror("write");
+                return 1;
+            }
+        }
+        samples[sample] = residentKb(shell);
+        printf("%9ld lines  VmRSS %6ld KB\n", sent, samples[sample]);
+    }
+    close(commands[1]);
+    int status;
+    waitpid(shell, &status, 0);
+    char store[sizeof(home) + 32];
+    snprintf(store, sizeof(store), "%s/.myshell_bookmarks", home);
+    unlink(store);
+    rmdir(home);
+
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        fprintf(stderr, "shell did not exit cleanly (status %d)\n", status);
+        return 1;
+    }
+    // The first sample is after warm-up, the arena and the slabs have their size by then
+    long highest = samples[0];
+    for(int sample = 0; sample < SOAK_SAMPLES; sample++){
+        if(samples[sample] < 0){
+            fprintf(stderr, "could not read VmRSS\n");
+            return 1;
+        }
+        if(samples[sample] > highest){
+            highest = samples[sample];
+        }
+    }
+    if(highest > samples[0] + SOAK_SLACK_KB){
+        fprintf(stderr, "VmRSS grew from %ld KB to %ld KB\n", samples[0], highest);
+        return 1;
+    }
+    return 0;
+}